@@ -0,0 +1,438 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Timing helpers for the headless benchmark mode and startup profiling. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+
+uint64_t
+get_time_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Returns the time in ns at which to draw the next frame, and counts the
+ * frame. */
+uint64_t
+animation_time(struct vkcube *vc)
+{
+   uint64_t frame = vc->frame_count++;
+
+   if (vc->time_step)
+      return frame * vc->time_step;
+
+   return get_time_ns() - vc->start_time;
+}
+
+void
+bench_stats_add(struct bench_stats *s, uint64_t ns)
+{
+   if (s->count == s->size) {
+      s->size = s->size ? s->size * 2 : 1024;
+      s->samples = realloc(s->samples, s->size * sizeof(s->samples[0]));
+      fail_if(!s->samples, "out of memory");
+   }
+
+   s->samples[s->count++] = ns;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+   return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(struct bench_stats *s, uint32_t p)
+{
+   uint32_t i = (uint64_t) (s->count - 1) * p / 100;
+
+   return s->samples[i];
+}
+
+/* Sorts the samples in place, so only call this once sampling is done. */
+void
+bench_stats_print(struct bench_stats *s, const char *name)
+{
+   if (s->count == 0) {
+      printf("%-22s no samples\n", name);
+      return;
+   }
+
+   uint64_t sum = 0;
+   for (uint32_t i = 0; i < s->count; i++)
+      sum += s->samples[i];
+
+   qsort(s->samples, s->count, sizeof(s->samples[0]), compare_u64);
+
+   printf("%-22s mean %8.3f ms, p50 %8.3f ms, p99 %8.3f ms\n", name,
+          (double) sum / s->count / 1e6,
+          percentile(s, 50) / 1e6,
+          percentile(s, 99) / 1e6);
+}
+
+void
+bench_stats_finish(struct bench_stats *s)
+{
+   free(s->samples);
+   s->samples = NULL;
+   s->count = 0;
+   s->size = 0;
+}
+
+void
+phase_timer_init(struct phase_timer *t, bool print)
+{
+   *t = (struct phase_timer) {
+      .start = get_time_ns(),
+      .print = print,
+   };
+   t->last = t->start;
+}
+
+/* Charges the time since the previous mark to the named phase. Marks with
+ * a name seen before add to that phase, and marks after phase_finish() are
+ * ignored, so callers on paths that repeat don't need to check. */
+void
+phase_mark(struct phase_timer *t, const char *name)
+{
+   if (t->done)
+      return;
+
+   uint64_t now = get_time_ns();
+   uint32_t i;
+
+   for (i = 0; i < t->count; i++) {
+      if (streq(t->phases[i].name, name))
+         break;
+   }
+
+   if (i == t->count) {
+      if (t->count == MAX_PHASES)
+         return;
+      t->phases[t->count++] = (struct phase) { .name = name };
+   }
+
+   t->phases[i].ns += now - t->last;
+   t->last = now;
+}
+
+/* Ends startup timing and, if requested, prints it as one line of JSON on
+ * stderr. Only the first call does anything. */
+void
+phase_finish(struct phase_timer *t)
+{
+   if (t->done)
+      return;
+
+   t->done = true;
+   if (!t->print)
+      return;
+
+   fprintf(stderr, "{\"phases_ms\": {");
+   for (uint32_t i = 0; i < t->count; i++)
+      fprintf(stderr, "%s\"%s\": %.3f", i ? ", " : "",
+              t->phases[i].name, t->phases[i].ns / 1e6);
+   fprintf(stderr, "}, \"total_ms\": %.3f}\n", (t->last - t->start) / 1e6);
+}
+
+/* GPU frame timing: each vkcube_buffer owns a pair of timestamp queries,
+ * written around its render pass. The results are read back when the
+ * buffer comes around again, after its fence has signaled, so reading
+ * them never stalls. */
+
+void
+gpu_timer_init(struct vkcube *vc, double interval)
+{
+   struct gpu_timer *t = &vc->gpu_timer;
+   uint32_t count;
+
+   *t = (struct gpu_timer) { .interval = interval };
+
+   if (vc->protected) {
+      printf("GPU timestamps can't be written from protected command "
+             "buffers, disabling\n");
+      return;
+   }
+
+   vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, NULL);
+   VkQueueFamilyProperties props[count];
+   vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, props);
+
+   uint32_t bits = props[vc->queue_family].timestampValidBits;
+   if (bits == 0) {
+      printf("GPU timestamps not supported, disabling\n");
+      return;
+   }
+
+   t->mask = bits == 64 ? UINT64_MAX : (1ull << bits) - 1;
+   t->period = vc->properties.limits.timestampPeriod;
+   t->last_print = get_time_ns();
+
+   vkCreateQueryPool(vc->device,
+                     &(VkQueryPoolCreateInfo) {
+                        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+                        .queryCount = 2 * MAX_NUM_IMAGES,
+                     },
+                     NULL,
+                     &t->query_pool);
+}
+
+void
+gpu_timer_begin(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   struct gpu_timer *t = &vc->gpu_timer;
+   uint32_t query = 2 * (b - vc->buffers);
+
+   if (t->query_pool == VK_NULL_HANDLE)
+      return;
+
+   vkCmdResetQueryPool(b->cmd_buffer, t->query_pool, query, 2);
+   vkCmdWriteTimestamp(b->cmd_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                       t->query_pool, query);
+}
+
+void
+gpu_timer_end(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   struct gpu_timer *t = &vc->gpu_timer;
+   uint32_t query = 2 * (b - vc->buffers);
+
+   if (t->query_pool == VK_NULL_HANDLE)
+      return;
+
+   vkCmdWriteTimestamp(b->cmd_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                       t->query_pool, query + 1);
+}
+
+static void
+gpu_timer_print(struct gpu_timer *t)
+{
+   uint32_t peak = 0;
+
+   if (t->count == 0)
+      return;
+
+   printf("gpu frame time: %u frames, min %.3f ms, mean %.3f ms, "
+          "max %.3f ms\n", t->count, t->min / 1e6,
+          (double) t->sum / t->count / 1e6, t->max / 1e6);
+
+   for (int i = 0; i < GPU_TIME_BUCKETS; i++)
+      peak = t->buckets[i] > peak ? t->buckets[i] : peak;
+
+   for (int i = 0; i < GPU_TIME_BUCKETS; i++) {
+      if (t->buckets[i] == 0)
+         continue;
+
+      int bar = (t->buckets[i] * 40 + peak - 1) / peak;
+      if (i == GPU_TIME_BUCKETS - 1)
+         printf("  %8.3f ms -          : %6u %.*s\n",
+                (GPU_TIME_BUCKET_NS << i) / 1e6, t->buckets[i], bar,
+                "########################################");
+      else
+         printf("  %8.3f ms - %8.3f ms: %6u %.*s\n",
+                i ? (GPU_TIME_BUCKET_NS << i) / 1e6 : 0.0,
+                (GPU_TIME_BUCKET_NS << (i + 1)) / 1e6, t->buckets[i], bar,
+                "########################################");
+   }
+
+   t->count = 0;
+   t->sum = 0;
+   t->min = 0;
+   t->max = 0;
+   memset(t->buckets, 0, sizeof(t->buckets));
+}
+
+/* Picks up the timestamps b wrote, if they are available. The histogram
+ * covers the frames since it was last printed. */
+void
+gpu_timer_collect(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   struct gpu_timer *t = &vc->gpu_timer;
+   uint64_t data[4];
+
+   if (t->query_pool == VK_NULL_HANDLE || !b->timestamps_pending)
+      return;
+
+   VkResult r = vkGetQueryPoolResults(vc->device, t->query_pool,
+                                      2 * (b - vc->buffers), 2,
+                                      sizeof(data), data, 2 * sizeof(data[0]),
+                                      VK_QUERY_RESULT_64_BIT |
+                                      VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+   if ((r != VK_SUCCESS && r != VK_NOT_READY) || !data[1] || !data[3])
+      return;
+
+   b->timestamps_pending = false;
+
+   uint64_t ns = ((data[2] - data[0]) & t->mask) * t->period;
+   int i = 0;
+   while (i < GPU_TIME_BUCKETS - 1 && ns >= GPU_TIME_BUCKET_NS << (i + 1))
+      i++;
+
+   t->buckets[i]++;
+   t->sum += ns;
+   t->min = t->count == 0 || ns < t->min ? ns : t->min;
+   t->max = ns > t->max ? ns : t->max;
+   t->count++;
+
+   uint64_t now = get_time_ns();
+   if (t->interval > 0 && now - t->last_print >= t->interval * 1e9) {
+      gpu_timer_print(t);
+      t->last_print = now;
+   }
+}
+
+/* Waits for the GPU, collects the outstanding timestamps and prints what
+ * hasn't been printed yet. */
+void
+gpu_timer_finish(struct vkcube *vc)
+{
+   if (vc->gpu_timer.query_pool == VK_NULL_HANDLE)
+      return;
+
+   vkDeviceWaitIdle(vc->device);
+   for (uint32_t i = 0; i < vc->image_count; i++)
+      gpu_timer_collect(vc, &vc->buffers[i]);
+
+   gpu_timer_print(&vc->gpu_timer);
+}
+
+/* Pipeline statistics: like the timestamps, one query per vkcube_buffer,
+ * read back without waiting once the buffer's fence has signaled. */
+
+void
+pipeline_stats_init(struct vkcube *vc)
+{
+   struct pipeline_stats *s = &vc->pipeline_stats;
+
+   *s = (struct pipeline_stats) { .query_pool = VK_NULL_HANDLE };
+
+   vkCreateQueryPool(vc->device,
+                     &(VkQueryPoolCreateInfo) {
+                        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                        .queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS,
+                        .queryCount = MAX_NUM_IMAGES,
+                        .pipelineStatistics =
+                           VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT |
+                           VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+                           VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+                           VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT,
+                     },
+                     NULL,
+                     &s->query_pool);
+}
+
+/* Must be recorded outside the render pass, before pipeline_stats_begin(). */
+void
+pipeline_stats_reset(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   if (vc->pipeline_stats.query_pool == VK_NULL_HANDLE)
+      return;
+
+   vkCmdResetQueryPool(b->cmd_buffer, vc->pipeline_stats.query_pool,
+                       b - vc->buffers, 1);
+}
+
+void
+pipeline_stats_begin(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   if (vc->pipeline_stats.query_pool == VK_NULL_HANDLE)
+      return;
+
+   vkCmdBeginQuery(b->cmd_buffer, vc->pipeline_stats.query_pool,
+                   b - vc->buffers, 0);
+}
+
+void
+pipeline_stats_end(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   if (vc->pipeline_stats.query_pool == VK_NULL_HANDLE)
+      return;
+
+   vkCmdEndQuery(b->cmd_buffer, vc->pipeline_stats.query_pool,
+                 b - vc->buffers);
+}
+
+void
+pipeline_stats_collect(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   struct pipeline_stats *s = &vc->pipeline_stats;
+   uint64_t data[PIPELINE_STATS_COUNT + 1];
+
+   if (s->query_pool == VK_NULL_HANDLE || !b->stats_pending)
+      return;
+
+   VkResult r = vkGetQueryPoolResults(vc->device, s->query_pool,
+                                      b - vc->buffers, 1,
+                                      sizeof(data), data, sizeof(data),
+                                      VK_QUERY_RESULT_64_BIT |
+                                      VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+   if ((r != VK_SUCCESS && r != VK_NOT_READY) || !data[PIPELINE_STATS_COUNT])
+      return;
+
+   b->stats_pending = false;
+
+   for (int i = 0; i < PIPELINE_STATS_COUNT; i++)
+      s->totals[i] += data[i];
+   s->count++;
+}
+
+void
+pipeline_stats_finish(struct vkcube *vc)
+{
+   struct pipeline_stats *s = &vc->pipeline_stats;
+
+   /* In the order of the bits set in pipeline_stats_init(), which is the
+    * order the results come back in. */
+   static const char *names[PIPELINE_STATS_COUNT] = {
+      "input assembly vertices",
+      "vertex shader invocations",
+      "clipping primitives",
+      "fragment shader invocations",
+   };
+
+   if (s->query_pool == VK_NULL_HANDLE)
+      return;
+
+   vkDeviceWaitIdle(vc->device);
+   for (uint32_t i = 0; i < vc->image_count; i++)
+      pipeline_stats_collect(vc, &vc->buffers[i]);
+
+   if (s->count == 0)
+      return;
+
+   printf("pipeline statistics, mean of %u frames:\n", s->count);
+   for (int i = 0; i < PIPELINE_STATS_COUNT; i++)
+      printf("  %-28s %12.1f\n", names[i], (double) s->totals[i] / s->count);
+}
@@ -0,0 +1,406 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Image output for headless mode: PNG writing, a pool of worker threads
+ * that encode captured frames off the render thread, and uncompressed
+ * frame streams. */
+
+#define _GNU_SOURCE /* for IOV_MAX */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* Writes RGBA pixels; use swizzle_bgra_to_rgba() on rendered images first. */
+void
+write_png(const char *path, int32_t width, int32_t height, int32_t stride, void *pixels)
+{
+   FILE *f = NULL;
+   png_structp png_writer = NULL;
+   png_infop png_info = NULL;
+
+   uint8_t *rows[height];
+
+   for (int32_t y = 0; y < height; y++)
+      rows[y] = pixels + y * stride;
+
+   f = fopen(path, "wb");
+   fail_if(!f, "failed to open file for writing: %s", path);
+
+   png_writer = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                        NULL, NULL, NULL);
+   fail_if (!png_writer, "failed to create png writer");
+
+   png_info = png_create_info_struct(png_writer);
+   fail_if(!png_info, "failed to create png writer info");
+
+   png_init_io(png_writer, f);
+   png_set_IHDR(png_writer, png_info,
+                width, height,
+                8, PNG_COLOR_TYPE_RGBA,
+                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+   png_write_info(png_writer, png_info);
+   png_set_rows(png_writer, png_info, rows);
+   png_write_png(png_writer, png_info, PNG_TRANSFORM_IDENTITY, NULL);
+
+   png_destroy_write_struct(&png_writer, &png_info);
+
+   fclose(f);
+}
+
+struct capture_job {
+   char path[32];
+   uint8_t *pixels;
+};
+
+/* The pool owns depth pixel buffers. A frame takes one from the free list
+ * and its job returns it once written, so at most depth jobs are ever
+ * queued, and capture_frame() blocks while the workers are behind. */
+struct capture {
+   uint32_t width, height;
+   uint32_t depth;
+
+   pthread_mutex_t lock;
+   pthread_cond_t queue_cond;   /* a job was queued, or quit was set */
+   pthread_cond_t free_cond;    /* a pixel buffer was returned */
+
+   struct capture_job *jobs;    /* ring of depth jobs */
+   uint32_t head, queued;
+
+   uint8_t **free;              /* stack of unused pixel buffers */
+   uint32_t free_count;
+
+   bool quit;
+   uint32_t written, stalls;
+
+   uint32_t worker_count;
+   pthread_t workers[];
+};
+
+static void *
+capture_worker(void *data)
+{
+   struct capture *c = data;
+
+   pthread_mutex_lock(&c->lock);
+   for (;;) {
+      while (c->queued == 0 && !c->quit)
+         pthread_cond_wait(&c->queue_cond, &c->lock);
+      if (c->queued == 0)
+         break;
+
+      struct capture_job job = c->jobs[c->head];
+      c->head = (c->head + 1) % c->depth;
+      c->queued--;
+      pthread_mutex_unlock(&c->lock);
+
+      swizzle_bgra_to_rgba(job.pixels, job.pixels, c->width * c->height);
+      write_png(job.path, c->width, c->height, c->width * 4, job.pixels);
+
+      pthread_mutex_lock(&c->lock);
+      c->free[c->free_count++] = job.pixels;
+      c->written++;
+      pthread_cond_signal(&c->free_cond);
+   }
+   pthread_mutex_unlock(&c->lock);
+
+   return NULL;
+}
+
+struct capture *
+capture_create(uint32_t width, uint32_t height, uint32_t worker_count)
+{
+   struct capture *c;
+
+   c = calloc(1, sizeof(*c) + worker_count * sizeof(c->workers[0]));
+   fail_if(!c, "out of memory");
+
+   c->width = width;
+   c->height = height;
+   c->depth = 2 * worker_count;
+   c->worker_count = worker_count;
+
+   c->jobs = calloc(c->depth, sizeof(c->jobs[0]));
+   c->free = calloc(c->depth, sizeof(c->free[0]));
+   fail_if(!c->jobs || !c->free, "out of memory");
+
+   for (uint32_t i = 0; i < c->depth; i++) {
+      c->free[i] = malloc((size_t) width * height * 4);
+      fail_if(!c->free[i], "out of memory");
+   }
+   c->free_count = c->depth;
+
+   pthread_mutex_init(&c->lock, NULL);
+   pthread_cond_init(&c->queue_cond, NULL);
+   pthread_cond_init(&c->free_cond, NULL);
+
+   for (uint32_t i = 0; i < worker_count; i++) {
+      int ret = pthread_create(&c->workers[i], NULL, capture_worker, c);
+      fail_if(ret != 0, "failed to create capture thread");
+   }
+
+   return c;
+}
+
+/* Copies the frame into a pooled buffer and queues it to be written to
+ * path. Only waits if every pooled buffer is still queued or being
+ * encoded. */
+void
+capture_frame(struct capture *c, const void *pixels, uint32_t stride,
+              const char *path)
+{
+   uint32_t row_size = c->width * 4;
+   uint8_t *dst;
+
+   pthread_mutex_lock(&c->lock);
+   if (c->free_count == 0) {
+      c->stalls++;
+      while (c->free_count == 0)
+         pthread_cond_wait(&c->free_cond, &c->lock);
+   }
+   dst = c->free[--c->free_count];
+   pthread_mutex_unlock(&c->lock);
+
+   for (uint32_t y = 0; y < c->height; y++)
+      memcpy(dst + y * row_size, (const uint8_t *) pixels + y * stride,
+             row_size);
+
+   pthread_mutex_lock(&c->lock);
+   struct capture_job *job = &c->jobs[(c->head + c->queued) % c->depth];
+   snprintf(job->path, sizeof(job->path), "%s", path);
+   job->pixels = dst;
+   c->queued++;
+   pthread_cond_signal(&c->queue_cond);
+   pthread_mutex_unlock(&c->lock);
+}
+
+/* Writes out everything still queued, then stops the workers. */
+void
+capture_destroy(struct capture *c)
+{
+   pthread_mutex_lock(&c->lock);
+   c->quit = true;
+   pthread_cond_broadcast(&c->queue_cond);
+   pthread_mutex_unlock(&c->lock);
+
+   for (uint32_t i = 0; i < c->worker_count; i++)
+      pthread_join(c->workers[i], NULL);
+
+   printf("captured %u frames, render thread waited on the encoders "
+          "%u times\n", c->written, c->stalls);
+
+   for (uint32_t i = 0; i < c->free_count; i++)
+      free(c->free[i]);
+   free(c->free);
+   free(c->jobs);
+
+   pthread_mutex_destroy(&c->lock);
+   pthread_cond_destroy(&c->queue_cond);
+   pthread_cond_destroy(&c->free_cond);
+   free(c);
+}
+
+/* Uncompressed streaming outputs. Frames are appended to one file
+ * descriptor, which may be a pipe, so every write has to cope with short
+ * writes. Raw frames go out with writev() straight from the caller's
+ * pixels; PPM and Y4M need a conversion pass into o->buffer first. */
+
+struct output {
+   enum output_format format;
+   int fd;
+   uint32_t width, height;
+   uint8_t *buffer;
+};
+
+static void
+write_all(int fd, struct iovec *iov, int count)
+{
+   while (count > 0) {
+      ssize_t n = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+      if (n < 0 && errno == EINTR)
+         continue;
+      fail_if(n < 0, "failed to write frame: %s", strerror(errno));
+
+      while (count > 0 && (size_t) n >= iov->iov_len) {
+         n -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (count > 0) {
+         iov->iov_base = (uint8_t *) iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+}
+
+static void
+write_string(int fd, const char *s)
+{
+   write_all(fd, &(struct iovec) { .iov_base = (void *) s,
+                                   .iov_len = strlen(s) }, 1);
+}
+
+bool
+output_format_from_name(const char *name, enum output_format *format)
+{
+   if (streq(name, "png"))
+      *format = OUTPUT_FORMAT_PNG;
+   else if (streq(name, "raw") || streq(name, "bgra"))
+      *format = OUTPUT_FORMAT_RAW;
+   else if (streq(name, "ppm"))
+      *format = OUTPUT_FORMAT_PPM;
+   else if (streq(name, "y4m"))
+      *format = OUTPUT_FORMAT_Y4M;
+   else
+      return false;
+
+   return true;
+}
+
+/* The stream takes ownership of fd. Y4M needs the frame rate for its
+ * header, given as fps_num / fps_den. */
+struct output *
+output_open(enum output_format format, int fd, uint32_t width,
+            uint32_t height, uint32_t fps_num, uint32_t fps_den)
+{
+   struct output *o = calloc(1, sizeof(*o));
+   fail_if(!o, "out of memory");
+
+   assert(format != OUTPUT_FORMAT_PNG);
+
+   o->format = format;
+   o->fd = fd;
+   o->width = width;
+   o->height = height;
+
+   if (format != OUTPUT_FORMAT_RAW) {
+      /* RGB for PPM, three full resolution planes for Y4M. */
+      o->buffer = malloc((size_t) width * height * 3);
+      fail_if(!o->buffer, "out of memory");
+   }
+
+   if (format == OUTPUT_FORMAT_Y4M) {
+      char header[128];
+      snprintf(header, sizeof(header),
+               "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C444\n",
+               width, height, fps_num, fps_den);
+      write_string(fd, header);
+   }
+
+   return o;
+}
+
+static void
+convert_to_rgb(struct output *o, const uint8_t *pixels, uint32_t stride)
+{
+   uint8_t *dst = o->buffer;
+
+   for (uint32_t y = 0; y < o->height; y++) {
+      const uint8_t *src = pixels + (size_t) y * stride;
+      for (uint32_t x = 0; x < o->width; x++) {
+         dst[0] = src[2];
+         dst[1] = src[1];
+         dst[2] = src[0];
+         dst += 3;
+         src += 4;
+      }
+   }
+}
+
+/* BT.601 limited range, in the usual 8-bit fixed point form. */
+static void
+convert_to_yuv444(struct output *o, const uint8_t *pixels, uint32_t stride)
+{
+   size_t plane = (size_t) o->width * o->height;
+   uint8_t *py = o->buffer, *pu = py + plane, *pv = pu + plane;
+
+   for (uint32_t y = 0; y < o->height; y++) {
+      const uint8_t *src = pixels + (size_t) y * stride;
+      for (uint32_t x = 0; x < o->width; x++) {
+         int b = src[0], g = src[1], r = src[2];
+         *py++ = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+         *pu++ = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+         *pv++ = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+         src += 4;
+      }
+   }
+}
+
+/* Appends one BGRA frame with the given row stride to the stream. */
+void
+output_write_frame(struct output *o, const void *pixels, uint32_t stride)
+{
+   size_t row_size = (size_t) o->width * 4;
+   char header[64];
+
+   switch (o->format) {
+   case OUTPUT_FORMAT_RAW:
+      if (stride == row_size) {
+         write_all(o->fd, &(struct iovec) {
+                      .iov_base = (void *) pixels,
+                      .iov_len = row_size * o->height }, 1);
+      } else {
+         struct iovec iov[o->height];
+         for (uint32_t y = 0; y < o->height; y++) {
+            iov[y].iov_base = (uint8_t *) pixels + (size_t) y * stride;
+            iov[y].iov_len = row_size;
+         }
+         write_all(o->fd, iov, o->height);
+      }
+      break;
+   case OUTPUT_FORMAT_PPM:
+      convert_to_rgb(o, pixels, stride);
+      snprintf(header, sizeof(header), "P6\n%u %u\n255\n",
+               o->width, o->height);
+      write_all(o->fd, (struct iovec[]) {
+                   { .iov_base = header, .iov_len = strlen(header) },
+                   { .iov_base = o->buffer,
+                     .iov_len = (size_t) o->width * o->height * 3 },
+                }, 2);
+      break;
+   case OUTPUT_FORMAT_Y4M:
+      convert_to_yuv444(o, pixels, stride);
+      write_all(o->fd, (struct iovec[]) {
+                   { .iov_base = "FRAME\n", .iov_len = 6 },
+                   { .iov_base = o->buffer,
+                     .iov_len = (size_t) o->width * o->height * 3 },
+                }, 2);
+      break;
+   default:
+      assert(!"unreachable");
+   }
+}
+
+void
+output_close(struct output *o)
+{
+   close(o->fd);
+   free(o->buffer);
+   free(o);
+}
@@ -27,10 +27,14 @@
 #include <gbm.h>
 
 #include "esUtil.h"
+#include "swizzle.h"
 
 #define printflike(a, b) __attribute__((format(printf, (a), (b))))
 
 #define MAX_NUM_IMAGES 5
+#define MAX_INSTANCE_ORDERS 8
+#define MAX_FRAMES_IN_FLIGHT MAX_NUM_IMAGES
+#define MAX_RECORD_THREADS 16
 
 struct vkcube_buffer {
    struct gbm_bo *gbm_bo;
@@ -38,24 +42,145 @@ struct vkcube_buffer {
    VkImage image;
    VkImageView view;
    VkFramebuffer framebuffer;
+
+   /* Transient attachments, lazily allocated where the device supports
+    * it, so they may never be backed by memory: the multisampled color
+    * buffer when vc->samples > 1, and the depth buffer with vc->depth. */
+   VkImage msaa_image;
+   VkDeviceMemory msaa_mem;
+   VkImageView msaa_view;
+   VkImage depth_image;
+   VkDeviceMemory depth_mem;
+   VkImageView depth_view;
+
+   /* Which copy of the instance data to draw, see render_cube(). */
+   uint32_t instance_order;
    VkFence fence;
    VkCommandBuffer cmd_buffer;
+   VkCommandPool cmd_pool;      /* with reset_pools only, else vc->cmd_pool */
+
+   /* Swapchain images only: signaled when rendering to this image is done,
+    * waited on by present. Reusing it is safe once the image has been
+    * acquired again. */
+   VkSemaphore render_semaphore;
+
+   /* Static recording mode: one command buffer per instance order, each
+    * recorded the first time its order is drawn. recorded has bit i set
+    * once static_cmds[i] holds a recording that can be resubmitted, and
+    * cmd_buffer is static_cmds[instance_order]. */
+   VkCommandBuffer static_cmds[MAX_INSTANCE_ORDERS];
+   uint32_t recorded;
+
+   /* Secondary recording mode: one transient pool and secondary command
+    * buffer per recording thread, each only touched by its thread. */
+   VkCommandPool secondary_pools[MAX_RECORD_THREADS];
+   VkCommandBuffer secondary_cmds[MAX_RECORD_THREADS];
+
+   /* Whether the last submit wrote GPU timestamps or pipeline statistics
+    * not yet read back. */
+   bool timestamps_pending;
+   bool stats_pending;
 
    uint32_t fb;
    uint32_t stride;
+
+   /* CLOCK_MONOTONIC time of the last submit, 0 once it has completed. */
+   uint64_t submit_time;
+
+   /* Headless only: host visible copy of the image, see init_readback(). */
+   VkBuffer readback_buffer;
+   VkDeviceMemory readback_mem;
+   VkDeviceSize readback_size;
+   void *readback_map;
+   bool readback_coherent;
+   VkCommandBuffer readback_cmd;
+   VkFence readback_fence;
+   bool readback_pending;
+};
+
+/* Per frame-in-flight state for the swapchain main loops. We don't know
+ * which image an acquire will return until it has signaled, so the acquire
+ * semaphore belongs to the frame slot rather than to the image. */
+struct vkcube_frame {
+   VkSemaphore acquire_semaphore;
+
+   /* The buffer last rendered from this frame slot, or NULL. Its fence
+    * tells us when the acquire semaphore can be reused. */
+   struct vkcube_buffer *buffer;
+};
+
+#define MAX_PHASES 16
+
+struct phase {
+   const char *name;
+   uint64_t ns;
+};
+
+/* Wall clock breakdown of startup, from main() to the first present. */
+struct phase_timer {
+   uint64_t start, last;
+   bool print, done;
+   uint32_t count;
+   struct phase phases[MAX_PHASES];
+};
+
+/* Histogram bucket i counts GPU frame times from GPU_TIME_BUCKET_NS << i up
+ * to twice that. The first bucket starts at 0, the last is open ended. */
+#define GPU_TIME_BUCKETS 16
+#define GPU_TIME_BUCKET_NS 16000ull
+
+struct gpu_timer {
+   VkQueryPool query_pool;      /* VK_NULL_HANDLE when disabled */
+   float period;                /* ns per timestamp tick */
+   uint64_t mask;               /* timestampValidBits */
+   double interval;             /* seconds between prints, 0 for exit only */
+   uint64_t last_print;
+
+   uint32_t count;
+   uint64_t sum, min, max;
+   uint32_t buckets[GPU_TIME_BUCKETS];
+};
+
+#define PIPELINE_STATS_COUNT 4
+
+struct pipeline_stats {
+   VkQueryPool query_pool;      /* VK_NULL_HANDLE when disabled */
+   uint32_t count;
+   uint64_t totals[PIPELINE_STATS_COUNT];
+};
+
+enum record_mode {
+   RECORD_MODE_DYNAMIC,         /* re-record the command buffer every frame */
+   RECORD_MODE_STATIC,          /* record once per buffer, then resubmit */
+   RECORD_MODE_SECONDARY,       /* record slices on threads every frame */
+};
+
+enum vertex_layout {
+   VERTEX_LAYOUT_SEPARATE,      /* one float binding per attribute */
+   VERTEX_LAYOUT_INTERLEAVED,   /* one binding, float attributes */
+   VERTEX_LAYOUT_PACKED,        /* one binding, unorm8 color, 2:10:10:10 normal */
 };
 
 struct vkcube;
 
 struct model {
    void (*init)(struct vkcube *vc);
-   void (*render)(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore);
+   void (*render)(struct vkcube *vc, struct vkcube_buffer *b,
+                  VkSemaphore wait_semaphore, VkSemaphore signal_semaphore);
 };
 
 struct vkcube {
    struct model model;
 
    bool protected;
+   bool pipeline_statistics;
+   int device_index;            /* -1 until init_vk() applies -G */
+   enum record_mode record_mode;
+   enum vertex_layout vertex_layout;
+   char *pipeline_cache_dir;    /* NULL disables the on-disk cache */
+   struct phase_timer phases;
+   struct gpu_timer gpu_timer;
+   struct pipeline_stats pipeline_stats;
 
    int fd;
    struct gbm_device *gbm_device;
@@ -80,6 +205,7 @@ struct vkcube {
       struct xdg_surface *xdg_surface;
       struct xdg_toplevel *xdg_toplevel;
       bool wait_for_configure;
+      bool quit;
    } wl;
 #endif
 
@@ -95,6 +221,8 @@ struct vkcube {
 
    VkInstance instance;
    VkPhysicalDevice physical_device;
+   uint32_t queue_family;
+   VkPhysicalDeviceProperties properties;
    VkPhysicalDeviceMemoryProperties memory_properties;
    VkDevice device;
    VkRenderPass render_pass;
@@ -103,14 +231,71 @@ struct vkcube {
    VkPipeline pipeline;
    VkDeviceMemory mem;
    VkBuffer buffer;
+   VkDeviceMemory vertex_mem;
+   VkBuffer vertex_buffer;
    VkDescriptorSet descriptor_set;
-   VkSemaphore semaphore;
    VkCommandPool cmd_pool;
+   struct recorder *recorder;   /* secondary recording mode only */
+   uint32_t record_threads;
+
+   /* Each frame's instances are drawn in draw_count draws of about equal
+    * size. In secondary mode, the draws are what gets split across the
+    * recording threads. */
+   uint32_t draw_count;
+
+   /* Give every vkcube_buffer its own transient pool and reset the whole
+    * pool each frame, instead of resetting cmd_buffer in vc->cmd_pool. */
+   bool reset_pools;
+
+   struct vkcube_frame frames[MAX_FRAMES_IN_FLIGHT];
+   uint32_t frames_in_flight;
+   uint32_t frame_index;
 
    void *map;
+   uint32_t ubo_stride;
    uint32_t vertex_offset, colors_offset, normals_offset;
+   uint32_t index_offset, index_count;
+
+   /* The cubes model draws instance_count cubes with instanced draws, with
+    * the per instance data at instance_offset in the vertex buffer. */
+   bool instanced;
+   uint32_t instance_count, instance_offset;
+   uint32_t triangle_count;     /* per instance */
+
+   /* Depth testing. With it, the instance data is stored instance_orders
+    * times, each walking the grid in a different direction, so a frame can
+    * draw roughly front to back and let early depth tests reject hidden
+    * fragments. */
+   bool depth;
+   uint32_t instance_orders;
+
+   /* Samples per pixel. Above 1, rendering goes to a multisampled
+    * attachment that is resolved into the buffer's image. */
+   uint32_t samples;
+
+   /* Memory of one vkcube_buffer's transient attachments, the multisampled
+    * color and the depth buffer. Swapchain recreation creates them again,
+    * so they are only described at startup. */
+   uint64_t transient_bytes;
+   bool transient_reported;
+
+   /* Animation clock. With time_step set, frame N is drawn at time
+    * N * time_step, so runs render the same frames regardless of how fast
+    * they go. Otherwise it's CLOCK_MONOTONIC time since start_time. */
+   uint64_t start_time;
+   uint64_t time_step;
+   uint64_t frame_count;
+
+   /* Bytes read back from the GPU in headless captures. readback_ns is
+    * the time spent waiting for the copy, invalidating and first reading
+    * the mapping; output_ns is the time spent handing the pixels on to
+    * the PNG workers or the output stream. */
+   uint64_t readback_bytes, readback_ns, output_ns;
+
+   /* Result of the headless benchmark, kept for the per-device summary. */
+   uint32_t bench_frames_done;
+   uint64_t bench_elapsed;
 
-   struct timeval start_tv;
    VkSurfaceKHR surface;
    VkFormat image_format;
    struct vkcube_buffer buffers[MAX_NUM_IMAGES];
@@ -118,6 +303,75 @@ struct vkcube {
    int current;
 };
 
+struct bench_stats {
+   uint64_t *samples;
+   uint32_t count, size;
+};
+
+uint64_t get_time_ns(void);
+void bench_stats_add(struct bench_stats *s, uint64_t ns);
+void bench_stats_print(struct bench_stats *s, const char *name);
+void bench_stats_finish(struct bench_stats *s);
+
+uint64_t animation_time(struct vkcube *vc);
+
+int find_memory_type(struct vkcube *vc, unsigned allowed,
+                     VkMemoryPropertyFlags required,
+                     VkMemoryPropertyFlags preferred);
+
+void write_png(const char *path, int32_t width, int32_t height,
+               int32_t stride, void *pixels);
+
+enum output_format {
+   OUTPUT_FORMAT_PNG,
+   OUTPUT_FORMAT_RAW,           /* BGRA frames back to back */
+   OUTPUT_FORMAT_PPM,           /* a P6 image per frame */
+   OUTPUT_FORMAT_Y4M,           /* YUV4MPEG2 stream, 4:4:4 */
+};
+
+struct output;
+bool output_format_from_name(const char *name, enum output_format *format);
+struct output *output_open(enum output_format format, int fd, uint32_t width,
+                           uint32_t height, uint32_t fps_num,
+                           uint32_t fps_den);
+void output_write_frame(struct output *o, const void *pixels,
+                        uint32_t stride);
+void output_close(struct output *o);
+
+struct capture;
+struct capture *capture_create(uint32_t width, uint32_t height,
+                               uint32_t worker_count);
+void capture_frame(struct capture *c, const void *pixels, uint32_t stride,
+                   const char *path);
+void capture_destroy(struct capture *c);
+
+struct recorder;
+struct recorder *recorder_create(uint32_t worker_count);
+void recorder_run(struct recorder *r, void (*func)(void *data, uint32_t worker),
+                  void *data);
+void recorder_destroy(struct recorder *r);
+
+void phase_timer_init(struct phase_timer *t, bool print);
+void phase_mark(struct phase_timer *t, const char *name);
+void phase_finish(struct phase_timer *t);
+
+void gpu_timer_init(struct vkcube *vc, double interval);
+void gpu_timer_begin(struct vkcube *vc, struct vkcube_buffer *b);
+void gpu_timer_end(struct vkcube *vc, struct vkcube_buffer *b);
+void gpu_timer_collect(struct vkcube *vc, struct vkcube_buffer *b);
+void gpu_timer_finish(struct vkcube *vc);
+
+void pipeline_stats_init(struct vkcube *vc);
+void pipeline_stats_reset(struct vkcube *vc, struct vkcube_buffer *b);
+void pipeline_stats_begin(struct vkcube *vc, struct vkcube_buffer *b);
+void pipeline_stats_end(struct vkcube *vc, struct vkcube_buffer *b);
+void pipeline_stats_collect(struct vkcube *vc, struct vkcube_buffer *b);
+void pipeline_stats_finish(struct vkcube *vc);
+
+VkPipelineCache load_pipeline_cache(struct vkcube *vc, size_t *loaded_size);
+void save_pipeline_cache(struct vkcube *vc, VkPipelineCache cache);
+char *default_pipeline_cache_dir(void);
+
 void noreturn failv(const char *format, va_list args);
 void noreturn fail(const char *format, ...) printflike(1, 2) ;
 void fail_if(int cond, const char *format, ...) printflike(2, 3);
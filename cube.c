@@ -23,6 +23,9 @@
  * IN THE SOFTWARE.
  */
 
+#include <math.h>
+#include <stddef.h>
+
 #include "common.h"
 
 struct ubo {
@@ -31,6 +34,20 @@ struct ubo {
    float normal[12];
 };
 
+/* Vertex formats for the single binding layouts. The separate layout keeps
+ * the position, color and normal arrays back to back instead. */
+struct interleaved_vertex {
+   float position[3];
+   float color[3];
+   float normal[3];
+};
+
+struct packed_vertex {
+   float position[3];
+   uint8_t color[4];            /* R8G8B8A8_UNORM */
+   uint32_t normal;             /* A2B10G10R10_SNORM_PACK32 */
+};
+
 static uint32_t vs_spirv_source[] = {
 #include "vkcube.vert.spv.h"
 };
@@ -39,22 +56,191 @@ static uint32_t fs_spirv_source[] = {
 #include "vkcube.frag.spv.h"
 };
 
-static int find_host_coherent_memory(struct vkcube *vc, unsigned allowed)
+/* vkcube.vert with a per instance offset and scale, for the cubes model. */
+static uint32_t instanced_vs_spirv_source[] = {
+#include "vkcubes.vert.spv.h"
+};
+
+/* Per instance data for the cubes model, matching in_instance. */
+struct instance {
+   float offset[3];
+   float scale;
+};
+
+static void
+create_buffer(struct vkcube *vc, VkDeviceSize size, VkBufferUsageFlags usage,
+              VkMemoryPropertyFlags required,
+              VkMemoryPropertyFlags preferred,
+              VkBuffer *buffer, VkDeviceMemory *mem)
 {
-    for (unsigned i = 0; (1u << i) <= allowed && i <= vc->memory_properties.memoryTypeCount; ++i) {
-        if ((allowed & (1u << i)) &&
-            (vc->memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
-            (vc->memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
-            return i;
-    }
-    return -1;
+   VkResult r;
+
+   r = vkCreateBuffer(vc->device,
+                      &(VkBufferCreateInfo) {
+                         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                         .size = size,
+                         .usage = usage,
+                         .flags = 0
+                      },
+                      NULL,
+                      buffer);
+   fail_if(r != VK_SUCCESS, "failed to create a %.1f MiB buffer",
+           size / 1048576.0);
+
+   VkMemoryRequirements reqs;
+   vkGetBufferMemoryRequirements(vc->device, *buffer, &reqs);
+
+   int memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                      required, preferred);
+   if (memory_type < 0)
+      fail("find_memory_type failed");
+
+   /* With a large -N the geometry can exceed what the device will
+    * allocate, so fail with the size rather than binding a null handle. */
+   r = vkAllocateMemory(vc->device,
+                        &(VkMemoryAllocateInfo) {
+                           .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                           .allocationSize = reqs.size,
+                           .memoryTypeIndex = memory_type,
+                        },
+                        NULL,
+                        mem);
+   fail_if(r != VK_SUCCESS, "failed to allocate %.1f MiB of buffer memory",
+           reqs.size / 1048576.0);
+
+   vkBindBufferMemory(vc->device, *buffer, *mem, 0);
 }
 
+/* Copies size bytes from a host visible staging buffer to dst and waits for
+ * the copy to finish. This only runs at startup, so a one-off command pool
+ * and a queue wait keep it simple. */
 static void
-init_cube(struct vkcube *vc)
+copy_buffer(struct vkcube *vc, VkBuffer src, VkBuffer dst, VkDeviceSize size)
+{
+   VkCommandPool pool;
+   VkCommandBuffer cmd_buffer;
+
+   vkCreateCommandPool(vc->device,
+                       &(const VkCommandPoolCreateInfo) {
+                          .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                          .queueFamilyIndex = vc->queue_family,
+                          .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT
+                       },
+                       NULL,
+                       &pool);
+
+   vkAllocateCommandBuffers(vc->device,
+      &(VkCommandBufferAllocateInfo) {
+         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+         .commandPool = pool,
+         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+         .commandBufferCount = 1,
+      },
+      &cmd_buffer);
+
+   vkBeginCommandBuffer(cmd_buffer,
+                        &(VkCommandBufferBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                           .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+                        });
+
+   vkCmdCopyBuffer(cmd_buffer, src, dst, 1,
+                   &(VkBufferCopy) { .srcOffset = 0, .dstOffset = 0, .size = size });
+
+   vkEndCommandBuffer(cmd_buffer);
+
+   vkQueueSubmit(vc->queue, 1,
+      &(VkSubmitInfo) {
+         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+         .commandBufferCount = 1,
+         .pCommandBuffers = &cmd_buffer,
+      }, VK_NULL_HANDLE);
+
+   vkQueueWaitIdle(vc->queue);
+
+   vkDestroyCommandPool(vc->device, pool, NULL);
+}
+
+static bool
+vertex_format_supported(struct vkcube *vc, VkFormat format)
+{
+   VkFormatProperties props;
+
+   vkGetPhysicalDeviceFormatProperties(vc->physical_device, format, &props);
+
+   return props.bufferFeatures & VK_FORMAT_FEATURE_VERTEX_BUFFER_BIT;
+}
+
+static uint32_t
+pack_snorm_2_10_10_10(const float v[3])
+{
+   uint32_t packed = 0;
+
+   for (int i = 0; i < 3; i++) {
+      float f = v[i] < -1.0f ? -1.0f : v[i] > 1.0f ? 1.0f : v[i];
+      int32_t x = f * 511.0f + (f < 0.0f ? -0.5f : 0.5f);
+      packed |= ((uint32_t) x & 0x3ff) << (10 * i);
+   }
+
+   return packed;
+}
+
+/* Lays the instances out on the smallest n x n x n grid that holds them,
+ * scaled to fill the same volume as the single cube. Bit i of order
+ * reverses the walk along axis i. */
+static void
+fill_instances(struct instance *instances, uint32_t count, uint32_t order)
+{
+   uint32_t n = cbrt(count);
+   while ((uint64_t) n * n * n < count)
+      n++;
+   float spacing = 2.0f / n;
+
+   for (uint32_t i = 0; i < count; i++) {
+      uint32_t x = i % n, y = i / n % n, z = i / n / n;
+
+      if (order & 1)
+         x = n - 1 - x;
+      if (order & 2)
+         y = n - 1 - y;
+      if (order & 4)
+         z = n - 1 - z;
+
+      instances[i] = (struct instance) {
+         .offset = {
+            -1.0f + spacing * (x + 0.5f),
+            -1.0f + spacing * (y + 0.5f),
+            -1.0f + spacing * (z + 0.5f),
+         },
+         .scale = spacing * 0.35f,
+      };
+   }
+}
+
+/* Sets up the pipeline and buffers for either model. The instanced variant
+ * adds a per instance vertex binding after the per vertex ones and draws
+ * vc->instance_count cubes in one call. */
+static void
+init_scene(struct vkcube *vc, bool instanced)
 {
    VkResult r;
 
+   vc->instanced = instanced;
+   if (!instanced)
+      vc->instance_count = 1;
+   if (vc->draw_count > vc->instance_count)
+      vc->draw_count = vc->instance_count;
+   vc->instance_orders = instanced && vc->depth ? MAX_INSTANCE_ORDERS : 1;
+   vc->triangle_count = 12;     /* two per face */
+
+   if (vc->vertex_layout == VERTEX_LAYOUT_PACKED &&
+       !(vertex_format_supported(vc, VK_FORMAT_A2B10G10R10_SNORM_PACK32) &&
+         vertex_format_supported(vc, VK_FORMAT_R8G8B8A8_UNORM))) {
+      printf("packed vertex formats not supported, "
+             "using interleaved float vertices\n");
+      vc->vertex_layout = VERTEX_LAYOUT_INTERLEAVED;
+   }
+
    VkDescriptorSetLayout set_layout;
    vkCreateDescriptorSetLayout(vc->device,
                                &(VkDescriptorSetLayoutCreateInfo) {
@@ -62,7 +248,7 @@ init_cube(struct vkcube *vc)
                                   .bindingCount = 1,
                                   .pBindings = (VkDescriptorSetLayoutBinding[]) {
                                      {
-                                        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
                                         .descriptorCount = 1,
                                         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
                                         .pImmutableSamplers = NULL
@@ -81,55 +267,109 @@ init_cube(struct vkcube *vc)
                           NULL,
                           &vc->pipeline_layout);
 
-   VkPipelineVertexInputStateCreateInfo vi_create_info = {
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-      .vertexBindingDescriptionCount = 3,
-      .pVertexBindingDescriptions = (VkVertexInputBindingDescription[]) {
-         {
-            .binding = 0,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         },
-         {
-            .binding = 1,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         },
-         {
-            .binding = 2,
+   VkVertexInputBindingDescription bindings[4];
+   VkVertexInputAttributeDescription attributes[4];
+   uint32_t binding_count, attribute_count = 3, vertex_size;
+
+   switch (vc->vertex_layout) {
+   case VERTEX_LAYOUT_SEPARATE:
+      binding_count = 3;
+      vertex_size = 9 * sizeof(float);
+      for (uint32_t i = 0; i < 3; i++) {
+         bindings[i] = (VkVertexInputBindingDescription) {
+            .binding = i,
             .stride = 3 * sizeof(float),
             .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         }
-      },
-      .vertexAttributeDescriptionCount = 3,
-      .pVertexAttributeDescriptions = (VkVertexInputAttributeDescription[]) {
-         {
-            .location = 0,
-            .binding = 0,
+         };
+         attributes[i] = (VkVertexInputAttributeDescription) {
+            .location = i,
+            .binding = i,
             .format = VK_FORMAT_R32G32B32_SFLOAT,
             .offset = 0
-         },
-         {
-            .location = 1,
-            .binding = 1,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         },
-         {
-            .location = 2,
-            .binding = 2,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         }
+         };
       }
+      break;
+   case VERTEX_LAYOUT_INTERLEAVED:
+      binding_count = 1;
+      vertex_size = sizeof(struct interleaved_vertex);
+      attributes[0] = (VkVertexInputAttributeDescription) {
+         .location = 0,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = offsetof(struct interleaved_vertex, position)
+      };
+      attributes[1] = (VkVertexInputAttributeDescription) {
+         .location = 1,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = offsetof(struct interleaved_vertex, color)
+      };
+      attributes[2] = (VkVertexInputAttributeDescription) {
+         .location = 2,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = offsetof(struct interleaved_vertex, normal)
+      };
+      break;
+   case VERTEX_LAYOUT_PACKED:
+      binding_count = 1;
+      vertex_size = sizeof(struct packed_vertex);
+      attributes[0] = (VkVertexInputAttributeDescription) {
+         .location = 0,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = offsetof(struct packed_vertex, position)
+      };
+      attributes[1] = (VkVertexInputAttributeDescription) {
+         .location = 1,
+         .format = VK_FORMAT_R8G8B8A8_UNORM,
+         .offset = offsetof(struct packed_vertex, color)
+      };
+      attributes[2] = (VkVertexInputAttributeDescription) {
+         .location = 2,
+         .format = VK_FORMAT_A2B10G10R10_SNORM_PACK32,
+         .offset = offsetof(struct packed_vertex, normal)
+      };
+      break;
+   default:
+      fail("bad vertex layout");
+   }
+
+   if (binding_count == 1) {
+      bindings[0] = (VkVertexInputBindingDescription) {
+         .binding = 0,
+         .stride = vertex_size,
+         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+      };
+   }
+
+   if (instanced) {
+      bindings[binding_count] = (VkVertexInputBindingDescription) {
+         .binding = binding_count,
+         .stride = sizeof(struct instance),
+         .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE
+      };
+      attributes[attribute_count++] = (VkVertexInputAttributeDescription) {
+         .location = 3,
+         .binding = binding_count,
+         .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+         .offset = 0
+      };
+      binding_count++;
+   }
+
+   VkPipelineVertexInputStateCreateInfo vi_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+      .vertexBindingDescriptionCount = binding_count,
+      .pVertexBindingDescriptions = bindings,
+      .vertexAttributeDescriptionCount = attribute_count,
+      .pVertexAttributeDescriptions = attributes
    };
 
    VkShaderModule vs_module;
    vkCreateShaderModule(vc->device,
                         &(VkShaderModuleCreateInfo) {
                            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-                           .codeSize = sizeof(vs_spirv_source),
-                           .pCode = (uint32_t *)vs_spirv_source,
+                           .codeSize = instanced ? sizeof(instanced_vs_spirv_source) :
+                                                   sizeof(vs_spirv_source),
+                           .pCode = instanced ? instanced_vs_spirv_source :
+                                                vs_spirv_source,
                         },
                         NULL,
                         &vs_module);
@@ -144,8 +384,14 @@ init_cube(struct vkcube *vc)
                         NULL,
                         &fs_module);
 
+   phase_mark(&vc->phases, "shader_modules");
+
+   size_t cache_size;
+   VkPipelineCache cache = load_pipeline_cache(vc, &cache_size);
+   uint64_t start = get_time_ns();
+
    vkCreateGraphicsPipelines(vc->device,
-      (VkPipelineCache) { VK_NULL_HANDLE },
+      cache,
       1,
       &(VkGraphicsPipelineCreateInfo) {
          .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
@@ -168,7 +414,7 @@ init_cube(struct vkcube *vc)
          .pInputAssemblyState = &(VkPipelineInputAssemblyStateCreateInfo) {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
             .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
-            .primitiveRestartEnable = false,
+            .primitiveRestartEnable = true,
          },
 
          .pViewportState = &(VkPipelineViewportStateCreateInfo) {
@@ -188,10 +434,13 @@ init_cube(struct vkcube *vc)
 
          .pMultisampleState = &(VkPipelineMultisampleStateCreateInfo) {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
-            .rasterizationSamples = 1,
+            .rasterizationSamples = vc->samples,
          },
          .pDepthStencilState = &(VkPipelineDepthStencilStateCreateInfo) {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+            .depthTestEnable = vc->depth,
+            .depthWriteEnable = vc->depth,
+            .depthCompareOp = VK_COMPARE_OP_LESS,
          },
 
          .pColorBlendState = &(VkPipelineColorBlendStateCreateInfo) {
@@ -224,6 +473,18 @@ init_cube(struct vkcube *vc)
       NULL,
       &vc->pipeline);
 
+   double pipeline_ms = (get_time_ns() - start) / 1e6;
+   if (cache_size > 0)
+      printf("pipeline created in %.3f ms, "
+             "cache loaded from disk (%zu bytes)\n", pipeline_ms, cache_size);
+   else
+      printf("pipeline created in %.3f ms, no cache loaded from disk\n",
+             pipeline_ms);
+
+   save_pipeline_cache(vc, cache);
+   vkDestroyPipelineCache(vc->device, cache, NULL);
+   phase_mark(&vc->phases, "pipeline");
+
    static const float vVertices[] = {
       // front
       -1.0f, -1.0f, +1.0f, // point blue
@@ -323,46 +584,115 @@ init_cube(struct vkcube *vc)
       +0.0f, -1.0f, +0.0f  // down
    };
 
-   vc->vertex_offset = sizeof(struct ubo);
+   /* One strip per face, separated by the primitive restart index, so the
+    * whole cube is a single indexed draw. */
+   static const uint16_t vIndices[] = {
+       0,  1,  2,  3, 0xffff, // front
+       4,  5,  6,  7, 0xffff, // back
+       8,  9, 10, 11, 0xffff, // right
+      12, 13, 14, 15, 0xffff, // left
+      16, 17, 18, 19, 0xffff, // top
+      20, 21, 22, 23          // bottom
+   };
+
+   /* Each vkcube_buffer gets its own uniform slot, so updating the uniforms
+    * for one frame never touches memory a frame in flight is reading. The
+    * slots are selected with a dynamic offset at bind time, which has to be
+    * a multiple of minUniformBufferOffsetAlignment. */
+   VkDeviceSize align = vc->properties.limits.minUniformBufferOffsetAlignment;
+   if (align == 0)
+      align = 1;
+   vc->ubo_stride = (sizeof(struct ubo) + align - 1) / align * align;
+
+   /* The uniforms are rewritten every frame, so they stay host visible. A
+    * device local and host visible type (resizable BAR on discrete GPUs)
+    * saves the GPU from reading them across the bus. */
+   VkDeviceSize ubo_size = vc->ubo_stride * MAX_NUM_IMAGES;
+   create_buffer(vc, ubo_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                 &vc->buffer, &vc->mem);
+
+   r = vkMapMemory(vc->device, vc->mem, 0, ubo_size, 0, &vc->map);
+   if (r != VK_SUCCESS)
+      fail("vkMapMemory failed");
+
+   const uint32_t num_vertices = sizeof(vVertices) / sizeof(vVertices[0]) / 3;
+
+   /* The geometry never changes, so it is uploaded once into device local
+    * memory. The color and normal offsets only matter for the separate
+    * layout. */
+   vc->vertex_offset = 0;
    vc->colors_offset = vc->vertex_offset + sizeof(vVertices);
    vc->normals_offset = vc->colors_offset + sizeof(vColors);
-   uint32_t mem_size = vc->normals_offset + sizeof(vNormals);
-
-   vkCreateBuffer(vc->device,
-                  &(VkBufferCreateInfo) {
-                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-                     .size = mem_size,
-                     .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                     .flags = 0
-                  },
-                  NULL,
-                  &vc->buffer);
+   vc->index_offset = vc->vertex_offset + num_vertices * vertex_size;
+   vc->index_count = sizeof(vIndices) / sizeof(vIndices[0]);
+   vc->instance_offset = (vc->index_offset + sizeof(vIndices) + 15) & ~15;
+   VkDeviceSize instances_size =
+      (VkDeviceSize) vc->instance_count * sizeof(struct instance);
+   VkDeviceSize geometry_size = instanced ?
+      vc->instance_offset + vc->instance_orders * instances_size :
+      vc->index_offset + sizeof(vIndices);
 
-   VkMemoryRequirements reqs;
-   vkGetBufferMemoryRequirements(vc->device, vc->buffer, &reqs);
+   VkBuffer staging_buffer;
+   VkDeviceMemory staging_mem;
+   void *map;
 
-   int memory_type = find_host_coherent_memory(vc, reqs.memoryTypeBits);
-   if (memory_type < 0)
-      fail("find_host_coherent_memory failed");
-
-   vkAllocateMemory(vc->device,
-                    &(VkMemoryAllocateInfo) {
-                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                       .allocationSize = mem_size,
-                       .memoryTypeIndex = memory_type,
-                    },
-                    NULL,
-                    &vc->mem);
-
-   r = vkMapMemory(vc->device, vc->mem, 0, mem_size, 0, &vc->map);
+   create_buffer(vc, geometry_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0,
+                 &staging_buffer, &staging_mem);
+
+   r = vkMapMemory(vc->device, staging_mem, 0, geometry_size, 0, &map);
    if (r != VK_SUCCESS)
       fail("vkMapMemory failed");
-   memcpy(vc->map + vc->vertex_offset, vVertices, sizeof(vVertices));
-   memcpy(vc->map + vc->colors_offset, vColors, sizeof(vColors));
-   memcpy(vc->map + vc->normals_offset, vNormals, sizeof(vNormals));
 
-   vkBindBufferMemory(vc->device, vc->buffer, vc->mem, 0);
+   switch (vc->vertex_layout) {
+   case VERTEX_LAYOUT_SEPARATE:
+      memcpy(map + vc->vertex_offset, vVertices, sizeof(vVertices));
+      memcpy(map + vc->colors_offset, vColors, sizeof(vColors));
+      memcpy(map + vc->normals_offset, vNormals, sizeof(vNormals));
+      break;
+   case VERTEX_LAYOUT_INTERLEAVED: {
+      struct interleaved_vertex *v = map + vc->vertex_offset;
+      for (uint32_t i = 0; i < num_vertices; i++) {
+         memcpy(v[i].position, &vVertices[i * 3], sizeof(v[i].position));
+         memcpy(v[i].color, &vColors[i * 3], sizeof(v[i].color));
+         memcpy(v[i].normal, &vNormals[i * 3], sizeof(v[i].normal));
+      }
+      break;
+   }
+   case VERTEX_LAYOUT_PACKED: {
+      struct packed_vertex *v = map + vc->vertex_offset;
+      for (uint32_t i = 0; i < num_vertices; i++) {
+         memcpy(v[i].position, &vVertices[i * 3], sizeof(v[i].position));
+         for (int j = 0; j < 3; j++)
+            v[i].color[j] = vColors[i * 3 + j] * 255.0f + 0.5f;
+         v[i].color[3] = 255;
+         v[i].normal = pack_snorm_2_10_10_10(&vNormals[i * 3]);
+      }
+      break;
+   }
+   }
+   memcpy(map + vc->index_offset, vIndices, sizeof(vIndices));
+   for (uint32_t i = 0; instanced && i < vc->instance_orders; i++)
+      fill_instances(map + vc->instance_offset + i * instances_size,
+                     vc->instance_count, i);
+
+   vkUnmapMemory(vc->device, staging_mem);
+
+   create_buffer(vc, geometry_size,
+                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                 VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0,
+                 &vc->vertex_buffer, &vc->vertex_mem);
+
+   copy_buffer(vc, staging_buffer, vc->vertex_buffer, geometry_size);
+
+   vkDestroyBuffer(vc->device, staging_buffer, NULL);
+   vkFreeMemory(vc->device, staging_mem, NULL);
 
    VkDescriptorPool desc_pool;
    const VkDescriptorPoolCreateInfo create_info = {
@@ -373,7 +703,7 @@ init_cube(struct vkcube *vc)
       .poolSizeCount = 1,
       .pPoolSizes = (VkDescriptorPoolSize[]) {
          {
-            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
             .descriptorCount = 1
          },
       }
@@ -397,7 +727,7 @@ init_cube(struct vkcube *vc)
                                 .dstBinding = 0,
                                 .dstArrayElement = 0,
                                 .descriptorCount = 1,
-                                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
                                 .pBufferInfo = &(VkDescriptorBufferInfo) {
                                    .buffer = vc->buffer,
                                    .offset = 0,
@@ -406,80 +736,79 @@ init_cube(struct vkcube *vc)
                              }
                           },
                           0, NULL);
+   phase_mark(&vc->phases, "buffers");
 }
 
 static void
-render_cube(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore)
+init_cube(struct vkcube *vc)
 {
-   struct ubo ubo;
-   struct timeval tv;
-   uint64_t t;
-
-   gettimeofday(&tv, NULL);
+   init_scene(vc, false);
+}
 
-   t = ((tv.tv_sec * 1000 + tv.tv_usec / 1000) -
-        (vc->start_tv.tv_sec * 1000 + vc->start_tv.tv_usec / 1000)) / 5;
+static void
+init_cubes(struct vkcube *vc)
+{
+   init_scene(vc, true);
+   printf("drawing %u cubes with %u instanced draw%s\n", vc->instance_count,
+          vc->draw_count, vc->draw_count > 1 ? "s" : "");
+}
 
-   esMatrixLoadIdentity(&ubo.modelview);
-   esTranslate(&ubo.modelview, 0.0f, 0.0f, -8.0f);
-   esRotate(&ubo.modelview, 45.0f + (0.25f * t), 1.0f, 0.0f, 0.0f);
-   esRotate(&ubo.modelview, 45.0f - (0.5f * t), 0.0f, 1.0f, 0.0f);
-   esRotate(&ubo.modelview, 10.0f + (0.15f * t), 0.0f, 0.0f, 1.0f);
+/* Part i of n split into parts of about equal size. Parts past n are
+ * empty. */
+static void
+slice(uint32_t n, uint32_t parts, uint32_t i, uint32_t *first, uint32_t *count)
+{
+   *first = (uint64_t) n * i / parts;
+   *count = (uint64_t) n * (i + 1) / parts - *first;
+}
 
-   float aspect = (float) vc->height / (float) vc->width;
-   ESMatrix projection;
-   esMatrixLoadIdentity(&projection);
-   esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+/* Binds everything the draws need and records count of the frame's draws
+ * starting at first, into either the primary or a secondary command
+ * buffer. */
+static void
+record_draws(struct vkcube *vc, struct vkcube_buffer *b, VkCommandBuffer cmd,
+             uint32_t first, uint32_t count)
+{
+   uint32_t ubo_offset = (b - vc->buffers) * vc->ubo_stride;
 
-   esMatrixLoadIdentity(&ubo.modelviewprojection);
-   esMatrixMultiply(&ubo.modelviewprojection, &ubo.modelview, &projection);
+   uint32_t binding_count;
+   if (vc->vertex_layout == VERTEX_LAYOUT_SEPARATE) {
+      vkCmdBindVertexBuffers(cmd, 0, 3,
+                             (VkBuffer[]) {
+                                vc->vertex_buffer,
+                                vc->vertex_buffer,
+                                vc->vertex_buffer
+                             },
+                             (VkDeviceSize[]) {
+                                vc->vertex_offset,
+                                vc->colors_offset,
+                                vc->normals_offset
+                              });
+      binding_count = 3;
+   } else {
+      vkCmdBindVertexBuffers(cmd, 0, 1,
+                             &vc->vertex_buffer,
+                             (VkDeviceSize[]) { vc->vertex_offset });
+      binding_count = 1;
+   }
 
-   /* The mat3 normalMatrix is laid out as 3 vec4s. */
-   memcpy(ubo.normal, &ubo.modelview, sizeof ubo.normal);
+   if (vc->instanced) {
+      VkDeviceSize offset = vc->instance_offset + (VkDeviceSize)
+         b->instance_order * vc->instance_count * sizeof(struct instance);
+      vkCmdBindVertexBuffers(cmd, binding_count, 1,
+                             &vc->vertex_buffer, &offset);
+   }
 
-   memcpy(vc->map, &ubo, sizeof(ubo));
+   vkCmdBindIndexBuffer(cmd, vc->vertex_buffer, vc->index_offset,
+                        VK_INDEX_TYPE_UINT16);
 
-   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
-   vkResetFences(vc->device, 1, &b->fence);
+   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, vc->pipeline);
 
-   vkBeginCommandBuffer(b->cmd_buffer,
-                        &(VkCommandBufferBeginInfo) {
-                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-                           .flags = 0
-                        });
-
-   vkCmdBeginRenderPass(b->cmd_buffer,
-                        &(VkRenderPassBeginInfo) {
-                           .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-                           .renderPass = vc->render_pass,
-                           .framebuffer = b->framebuffer,
-                           .renderArea = { { 0, 0 }, { vc->width, vc->height } },
-                           .clearValueCount = 1,
-                           .pClearValues = (VkClearValue []) {
-                              { .color = { .float32 = { 0.2f, 0.2f, 0.2f, 1.0f } } }
-                           }
-                        },
-                        VK_SUBPASS_CONTENTS_INLINE);
-
-   vkCmdBindVertexBuffers(b->cmd_buffer, 0, 3,
-                          (VkBuffer[]) {
-                             vc->buffer,
-                             vc->buffer,
-                             vc->buffer
-                          },
-                          (VkDeviceSize[]) {
-                             vc->vertex_offset,
-                             vc->colors_offset,
-                             vc->normals_offset
-                           });
-
-   vkCmdBindPipeline(b->cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vc->pipeline);
-
-   vkCmdBindDescriptorSets(b->cmd_buffer,
+   vkCmdBindDescriptorSets(cmd,
                            VK_PIPELINE_BIND_POINT_GRAPHICS,
                            vc->pipeline_layout,
                            0, 1,
-                           &vc->descriptor_set, 0, NULL);
+                           &vc->descriptor_set, 1, &ubo_offset);
 
    const VkViewport viewport = {
       .x = 0,
@@ -489,24 +818,191 @@ render_cube(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore)
       .minDepth = 0,
       .maxDepth = 1,
    };
-   vkCmdSetViewport(b->cmd_buffer, 0, 1, &viewport);
+   vkCmdSetViewport(cmd, 0, 1, &viewport);
 
    const VkRect2D scissor = {
       .offset = { 0, 0 },
       .extent = { vc->width, vc->height },
    };
-   vkCmdSetScissor(b->cmd_buffer, 0, 1, &scissor);
+   vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+   for (uint32_t i = first; i < first + count; i++) {
+      uint32_t first_instance, instance_count;
 
-   vkCmdDraw(b->cmd_buffer, 4, 1, 0, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 4, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 8, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 12, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 16, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 20, 0);
+      slice(vc->instance_count, vc->draw_count, i,
+            &first_instance, &instance_count);
+      vkCmdDrawIndexed(cmd, vc->index_count, instance_count, 0, 0,
+                       first_instance);
+   }
+}
+
+struct secondary_job {
+   struct vkcube *vc;
+   struct vkcube_buffer *b;
+};
+
+/* Runs on recording thread worker. The buffer's previous submission has
+ * completed, so its pool can be reset wholesale. */
+static void
+record_secondary(void *data, uint32_t worker)
+{
+   struct secondary_job *job = data;
+   struct vkcube *vc = job->vc;
+   struct vkcube_buffer *b = job->b;
+   VkCommandBuffer cmd = b->secondary_cmds[worker];
+   uint32_t first, count;
+
+   slice(vc->draw_count, vc->record_threads, worker, &first, &count);
+   if (count == 0)
+      return;
+
+   vkResetCommandPool(vc->device, b->secondary_pools[worker], 0);
+
+   vkBeginCommandBuffer(cmd,
+      &(VkCommandBufferBeginInfo) {
+         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+         .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                  VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+         .pInheritanceInfo = &(VkCommandBufferInheritanceInfo) {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+            .renderPass = vc->render_pass,
+            .subpass = 0,
+            .framebuffer = b->framebuffer,
+         },
+      });
+
+   record_draws(vc, b, cmd, first, count);
+
+   vkEndCommandBuffer(cmd);
+}
+
+static void
+record_cube(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   bool secondary = vc->record_mode == RECORD_MODE_SECONDARY;
+   const VkClearValue color = {
+      .color = { .float32 = { 0.2f, 0.2f, 0.2f, 1.0f } }
+   };
+
+   /* One clear value per render pass attachment, in the same order. */
+   VkClearValue clear_values[3];
+   uint32_t clear_count = 0;
+   clear_values[clear_count++] = color;
+   if (vc->samples > 1)
+      clear_values[clear_count++] = color;
+   if (vc->depth)
+      clear_values[clear_count++] = (VkClearValue) {
+         .depthStencil = { .depth = 1.0f }
+      };
+
+   if (secondary) {
+      recorder_run(vc->recorder, record_secondary,
+                   &(struct secondary_job) { .vc = vc, .b = b });
+   }
+
+   /* The buffer's last submission has completed, so with per-buffer pools
+    * everything allocated for it can be recycled in one go. */
+   if (vc->reset_pools)
+      vkResetCommandPool(vc->device, b->cmd_pool, 0);
+
+   vkBeginCommandBuffer(b->cmd_buffer,
+                        &(VkCommandBufferBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                           .flags = vc->reset_pools ?
+                              VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0
+                        });
+
+   gpu_timer_begin(vc, b);
+   pipeline_stats_reset(vc, b);
+
+   vkCmdBeginRenderPass(b->cmd_buffer,
+                        &(VkRenderPassBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+                           .renderPass = vc->render_pass,
+                           .framebuffer = b->framebuffer,
+                           .renderArea = { { 0, 0 }, { vc->width, vc->height } },
+                           .clearValueCount = clear_count,
+                           .pClearValues = clear_values
+                        },
+                        secondary ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS :
+                                    VK_SUBPASS_CONTENTS_INLINE);
+
+   if (secondary) {
+      VkCommandBuffer cmds[MAX_RECORD_THREADS];
+      uint32_t cmd_count = 0, first, count;
+
+      for (uint32_t i = 0; i < vc->record_threads; i++) {
+         slice(vc->draw_count, vc->record_threads, i, &first, &count);
+         if (count > 0)
+            cmds[cmd_count++] = b->secondary_cmds[i];
+      }
+      vkCmdExecuteCommands(b->cmd_buffer, cmd_count, cmds);
+   } else {
+      pipeline_stats_begin(vc, b);
+      record_draws(vc, b, b->cmd_buffer, 0, vc->draw_count);
+      pipeline_stats_end(vc, b);
+   }
 
    vkCmdEndRenderPass(b->cmd_buffer);
 
+   gpu_timer_end(vc, b);
+
    vkEndCommandBuffer(b->cmd_buffer);
+}
+
+static void
+render_cube(struct vkcube *vc, struct vkcube_buffer *b,
+            VkSemaphore wait_semaphore, VkSemaphore signal_semaphore)
+{
+   struct ubo ubo;
+
+   /* One unit of t is 5 ms of animation time. */
+   double t = animation_time(vc) / 5e6;
+
+   esMatrixLoadIdentity(&ubo.modelview);
+   esTranslate(&ubo.modelview, 0.0f, 0.0f, -8.0f);
+   esRotate(&ubo.modelview, 45.0 + (0.25 * t), 1.0f, 0.0f, 0.0f);
+   esRotate(&ubo.modelview, 45.0 - (0.5 * t), 0.0f, 1.0f, 0.0f);
+   esRotate(&ubo.modelview, 10.0 + (0.15 * t), 0.0f, 0.0f, 1.0f);
+
+   float aspect = (float) vc->height / (float) vc->width;
+   ESMatrix projection;
+   esMatrixLoadIdentity(&projection);
+   esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+
+   esMatrixLoadIdentity(&ubo.modelviewprojection);
+   esMatrixMultiply(&ubo.modelviewprojection, &ubo.modelview, &projection);
+
+   /* The mat3 normalMatrix is laid out as 3 vec4s. */
+   memcpy(ubo.normal, &ubo.modelview, sizeof ubo.normal);
+
+   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+   vkResetFences(vc->device, 1, &b->fence);
+   gpu_timer_collect(vc, b);
+   pipeline_stats_collect(vc, b);
+
+   memcpy(vc->map + (b - vc->buffers) * vc->ubo_stride, &ubo, sizeof(ubo));
+
+   /* Draw the grid nearest layer first: walk each axis from the end that
+    * faces the viewer, ie. whose modelview z is larger. Column i of the
+    * modelview matrix is object axis i in eye space. */
+   b->instance_order = 0;
+   for (uint32_t i = 0; vc->instance_orders > 1 && i < 3; i++) {
+      if (ubo.modelview.m[i][2] > 0.0f)
+         b->instance_order |= 1 << i;
+   }
+
+   /* Only the instance order changes from frame to frame, so in static
+    * mode each order's command buffer is recorded the first time it is
+    * used. init_buffer() clears b->recorded, which covers swapchain
+    * recreation and resizes. */
+   if (vc->record_mode == RECORD_MODE_STATIC)
+      b->cmd_buffer = b->static_cmds[b->instance_order];
+   if (vc->record_mode != RECORD_MODE_STATIC ||
+       !(b->recorded & (1u << b->instance_order))) {
+      record_cube(vc, b);
+      b->recorded |= 1u << b->instance_order;
+   }
 
    VkProtectedSubmitInfo protected_info = {
       .sType = VK_STRUCTURE_TYPE_PROTECTED_SUBMIT_INFO,
@@ -517,18 +1013,28 @@ render_cube(struct vkcube *vc, struct vkcube_buffer *b, bool wait_semaphore)
       &(VkSubmitInfo) {
          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
          .pNext = &protected_info,
-         /* headless mode does not signal vc->semaphore */
+         /* headless and kms modes have no semaphores to wait on or signal */
          .waitSemaphoreCount = wait_semaphore ? 1 : 0,
-         .pWaitSemaphores = &vc->semaphore,
+         .pWaitSemaphores = &wait_semaphore,
          .pWaitDstStageMask = (VkPipelineStageFlags []) {
             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
          },
          .commandBufferCount = 1,
          .pCommandBuffers = &b->cmd_buffer,
+         .signalSemaphoreCount = signal_semaphore ? 1 : 0,
+         .pSignalSemaphores = &signal_semaphore,
       }, b->fence);
+
+   b->timestamps_pending = vc->gpu_timer.query_pool != VK_NULL_HANDLE;
+   b->stats_pending = vc->pipeline_stats.query_pool != VK_NULL_HANDLE;
 }
 
 struct model cube_model = {
    .init = init_cube,
    .render = render_cube
 };
+
+struct model cubes_model = {
+   .init = init_cubes,
+   .render = render_cube
+};
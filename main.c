@@ -56,6 +56,7 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <linux/input.h>
+#include <pthread.h>
 
 #include "common.h"
 
@@ -76,6 +77,32 @@ static enum display_mode display_mode = DISPLAY_MODE_AUTO;
 static uint32_t width = 1024, height = 768;
 static const char *arg_out_file = "./cube.png";
 static bool protected_chain = false;
+static int bench_frames = 0;
+static double bench_seconds = 0;
+static int frames_in_flight = 2;
+static enum record_mode record_mode = RECORD_MODE_DYNAMIC;
+static enum vertex_layout vertex_layout = VERTEX_LAYOUT_INTERLEAVED;
+static const char *arg_pipeline_cache_dir = NULL;
+static bool print_phases = false;
+static double gpu_timing_interval = -1;
+static bool pipeline_statistics = false;
+static double time_step_ms = 0;
+static int capture_interval = 0;
+static enum output_format output_format = OUTPUT_FORMAT_PNG;
+static bool found_arg_output_format = false;
+static int output_fd = -1;
+static const char *arg_device = NULL;
+static bool all_devices = false;
+static bool many_cubes = false;
+static int instance_count = 0;
+static int record_threads = 0;
+static int draw_count = 0;
+static bool reset_pools = false;
+static bool depth_buffer = false;
+static int samples = 1;
+
+/* Every implementation supports D16 depth attachments. */
+static const VkFormat depth_format = VK_FORMAT_D16_UNORM;
 
 void noreturn
 failv(const char *format, va_list args)
@@ -126,16 +153,141 @@ static int find_image_memory(struct vkcube *vc, unsigned allowed)
       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
       (vc->protected ? VK_MEMORY_PROPERTY_PROTECTED_BIT : 0);
 
-    for (unsigned i = 0; (1u << i) <= allowed && i <= vc->memory_properties.memoryTypeCount; ++i) {
+    for (unsigned i = 0; (1u << i) <= allowed && i < vc->memory_properties.memoryTypeCount; ++i) {
         if ((allowed & (1u << i)) && (vc->memory_properties.memoryTypes[i].propertyFlags & flags))
             return i;
     }
     return -1;
 }
 
+/* Returns a memory type with all the required property flags, preferring
+ * one that also has the preferred flags, or -1 if there is none. */
+int
+find_memory_type(struct vkcube *vc, unsigned allowed,
+                 VkMemoryPropertyFlags required,
+                 VkMemoryPropertyFlags preferred)
+{
+   const VkPhysicalDeviceMemoryProperties *props = &vc->memory_properties;
+   VkMemoryPropertyFlags want[] = { required | preferred, required };
+
+   for (unsigned pass = 0; pass < 2; pass++) {
+      for (unsigned i = 0; i < props->memoryTypeCount; i++) {
+         if ((allowed & (1u << i)) &&
+             (props->memoryTypes[i].propertyFlags & want[pass]) == want[pass])
+            return i;
+      }
+   }
+
+   return -1;
+}
+
+static const char *
+device_type_name(VkPhysicalDeviceType type)
+{
+   switch (type) {
+   case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+      return "integrated";
+   case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+      return "discrete";
+   case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+      return "virtual";
+   case VK_PHYSICAL_DEVICE_TYPE_CPU:
+      return "cpu";
+   default:
+      return "other";
+   }
+}
+
+/* Parses a device UUID given as 32 hex digits, dashes allowed anywhere. */
+static bool
+parse_uuid(const char *s, uint8_t uuid[VK_UUID_SIZE])
+{
+   int n = 0;
+
+   for (; *s; s++) {
+      int v;
+
+      if (*s == '-')
+         continue;
+      else if (*s >= '0' && *s <= '9')
+         v = *s - '0';
+      else if (*s >= 'a' && *s <= 'f')
+         v = *s - 'a' + 10;
+      else if (*s >= 'A' && *s <= 'F')
+         v = *s - 'A' + 10;
+      else
+         return false;
+
+      if (n == 2 * VK_UUID_SIZE)
+         return false;
+      if (n % 2 == 0)
+         uuid[n / 2] = v << 4;
+      else
+         uuid[n / 2] |= v;
+      n++;
+   }
+
+   return n == 2 * VK_UUID_SIZE;
+}
+
+/* Returns the index of the device given by -G: an index, a device UUID, a
+ * device type or a substring of the device name. Without -G, the first
+ * device. */
+static uint32_t
+select_physical_device(struct vkcube *vc, VkPhysicalDevice *pd,
+                       uint32_t count)
+{
+   const char *sel = arg_device;
+   uint8_t uuid[VK_UUID_SIZE];
+   char *end;
+
+   if (vc->device_index >= 0) {
+      fail_if((uint32_t) vc->device_index >= count,
+              "device %d not found", vc->device_index);
+      return vc->device_index;
+   }
+
+   if (!sel)
+      return 0;
+
+   unsigned long index = strtoul(sel, &end, 10);
+   if (end != sel && *end == '\0') {
+      fail_if(index >= count, "device %lu not found, %u devices present",
+              index, count);
+      return index;
+   }
+
+   bool by_uuid = parse_uuid(sel, uuid);
+
+   for (uint32_t i = 0; i < count; i++) {
+      VkPhysicalDeviceIDProperties id = {
+         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+      };
+      VkPhysicalDeviceProperties2 props = {
+         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+         .pNext = &id,
+      };
+      vkGetPhysicalDeviceProperties2(pd[i], &props);
+
+      if (by_uuid ? memcmp(id.deviceUUID, uuid, VK_UUID_SIZE) == 0 :
+          streq(sel, device_type_name(props.properties.deviceType)) ||
+          strstr(props.properties.deviceName, sel))
+         return i;
+   }
+
+   fail("no device matches '%s'", sel);
+}
+
+/* present_support, when given, reports whether a queue family of the
+ * selected device can present to the window system; the surface itself
+ * isn't created until the device exists. */
 static void
-init_vk(struct vkcube *vc, const char *extension)
+init_vk(struct vkcube *vc, const char *extension,
+        bool (*present_support)(struct vkcube *vc, uint32_t queue_family))
 {
+   /* Everything before this point is display or window setup. */
+   phase_mark(&vc->phases, "display");
+
    VkResult res = vkCreateInstance(&(VkInstanceCreateInfo) {
          .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
          .pApplicationInfo = &(VkApplicationInfo) {
@@ -152,13 +304,15 @@ init_vk(struct vkcube *vc, const char *extension)
       NULL,
       &vc->instance);
    fail_if(res != VK_SUCCESS, "Failed to create Vulkan instance.\n");
+   phase_mark(&vc->phases, "instance");
 
    uint32_t count;
    res = vkEnumeratePhysicalDevices(vc->instance, &count, NULL);
    fail_if(res != VK_SUCCESS || count == 0, "No Vulkan devices found.\n");
    VkPhysicalDevice pd[count];
    vkEnumeratePhysicalDevices(vc->instance, &count, pd);
-   vc->physical_device = pd[0];
+   vc->device_index = select_physical_device(vc, pd, count);
+   vc->physical_device = pd[vc->device_index];
    printf("%d physical devices\n", count);
 
    VkPhysicalDeviceProtectedMemoryFeatures protected_features = {
@@ -174,10 +328,34 @@ init_vk(struct vkcube *vc, const char *extension)
       printf("Requested protected memory but not supported by device, dropping...\n");
    vc->protected = protected_chain && protected_features.protectedMemory;
 
-   VkPhysicalDeviceProperties properties;
-   vkGetPhysicalDeviceProperties(vc->physical_device, &properties);
-   printf("vendor id %04x, device name %s\n",
-          properties.vendorID, properties.deviceName);
+   if (vc->pipeline_statistics && !features.features.pipelineStatisticsQuery) {
+      printf("Requested pipeline statistics but not supported by device, dropping...\n");
+      vc->pipeline_statistics = false;
+   } else if (vc->pipeline_statistics && vc->protected) {
+      printf("Pipeline statistics can't be queried from protected command buffers, dropping...\n");
+      vc->pipeline_statistics = false;
+   } else if (vc->pipeline_statistics &&
+              vc->record_mode == RECORD_MODE_SECONDARY) {
+      printf("Pipeline statistics aren't collected across secondary command buffers, dropping...\n");
+      vc->pipeline_statistics = false;
+   }
+
+   vkGetPhysicalDeviceProperties(vc->physical_device, &vc->properties);
+   printf("vendor id %04x, device name %s (%s)\n",
+          vc->properties.vendorID, vc->properties.deviceName,
+          device_type_name(vc->properties.deviceType));
+
+   VkSampleCountFlags sample_counts =
+      vc->properties.limits.framebufferColorSampleCounts &
+      (vc->depth ? vc->properties.limits.framebufferDepthSampleCounts : ~0u);
+   if (!(sample_counts & vc->samples)) {
+      uint32_t s = vc->samples;
+      while (s > 1 && !(sample_counts & s))
+         s >>= 1;
+      printf("Requested %ux multisampling but not supported by device, using %ux...\n",
+             vc->samples, s);
+      vc->samples = s;
+   }
 
    vkGetPhysicalDeviceMemoryProperties(vc->physical_device, &vc->memory_properties);
 
@@ -185,7 +363,17 @@ init_vk(struct vkcube *vc, const char *extension)
    assert(count > 0);
    VkQueueFamilyProperties props[count];
    vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, props);
-   assert(props[0].queueFlags & VK_QUEUE_GRAPHICS_BIT);
+   VkQueueFlags queue_flags = VK_QUEUE_GRAPHICS_BIT |
+      (vc->protected ? VK_QUEUE_PROTECTED_BIT : 0);
+   for (vc->queue_family = 0; vc->queue_family < count; vc->queue_family++) {
+      if ((props[vc->queue_family].queueFlags & queue_flags) == queue_flags &&
+          (!present_support || present_support(vc, vc->queue_family)))
+         break;
+   }
+   fail_if(vc->queue_family == count, present_support ?
+           "device has no graphics queue that can present" :
+           "device has no graphics queue");
+   phase_mark(&vc->phases, "physical_device");
 
    vkCreateDevice(vc->physical_device,
                   &(VkDeviceCreateInfo) {
@@ -193,7 +381,7 @@ init_vk(struct vkcube *vc, const char *extension)
                      .queueCreateInfoCount = 1,
                      .pQueueCreateInfos = &(VkDeviceQueueCreateInfo) {
                         .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                        .queueFamilyIndex = 0,
+                        .queueFamilyIndex = vc->queue_family,
                         .queueCount = 1,
                         .flags = vc->protected ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
                         .pQueuePriorities = (float []) { 1.0f },
@@ -202,6 +390,9 @@ init_vk(struct vkcube *vc, const char *extension)
                      .ppEnabledExtensionNames = (const char * const []) {
                         VK_KHR_SWAPCHAIN_EXTENSION_NAME,
                      },
+                     .pEnabledFeatures = &(VkPhysicalDeviceFeatures) {
+                        .pipelineStatisticsQuery = vc->pipeline_statistics,
+                     },
                   },
                   NULL,
                   &vc->device);
@@ -209,28 +400,129 @@ init_vk(struct vkcube *vc, const char *extension)
    vkGetDeviceQueue2(vc->device, &(VkDeviceQueueInfo2) {
          .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_INFO_2,
          .flags = vc->protected ? VK_DEVICE_QUEUE_CREATE_PROTECTED_BIT : 0,
-         .queueFamilyIndex = 0,
+         .queueFamilyIndex = vc->queue_family,
          .queueIndex = 0,
       }, &vc->queue);
+   phase_mark(&vc->phases, "device");
+}
+
+static VkSemaphore
+create_semaphore(struct vkcube *vc)
+{
+   VkSemaphore semaphore;
+
+   vkCreateSemaphore(vc->device,
+                     &(VkSemaphoreCreateInfo) {
+                        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                     },
+                     NULL,
+                     &semaphore);
+
+   return semaphore;
+}
+
+static void
+init_frames(struct vkcube *vc)
+{
+   for (uint32_t i = 0; i < vc->frames_in_flight; i++) {
+      vc->frames[i].acquire_semaphore = create_semaphore(vc);
+      vc->frames[i].buffer = NULL;
+   }
+   vc->frame_index = 0;
 }
 
 static void
 init_vk_objects(struct vkcube *vc)
 {
+   /* Attachment 0 is the image that gets presented or read back. With
+    * multisampling, rendering goes to a multisampled color attachment
+    * instead, resolved into attachment 0 at the end of the subpass. The
+    * multisampled color and the depth attachment are cleared on load and
+    * never stored, so their contents never need to reach memory. */
+   bool msaa = vc->samples > 1;
+   VkAttachmentDescription attachments[3];
+   uint32_t attachment_count = 0;
+
+   attachments[attachment_count++] = (VkAttachmentDescription) {
+      .format = vc->image_format,
+      .samples = 1,
+      .loadOp = msaa ? VK_ATTACHMENT_LOAD_OP_DONT_CARE :
+                       VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+   };
+
+   uint32_t color_attachment = 0;
+   if (msaa) {
+      color_attachment = attachment_count;
+      attachments[attachment_count++] = (VkAttachmentDescription) {
+         .format = vc->image_format,
+         .samples = vc->samples,
+         .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+         .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+         .finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      };
+   }
+
+   uint32_t depth_attachment = VK_ATTACHMENT_UNUSED;
+   if (vc->depth) {
+      depth_attachment = attachment_count;
+      attachments[attachment_count++] = (VkAttachmentDescription) {
+         .format = depth_format,
+         .samples = vc->samples,
+         .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+         .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+         .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+         .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+         .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+      };
+   }
+
+   VkSubpassDependency dependencies[2];
+   uint32_t dependency_count = 0;
+
+   /* A vkcube_buffer's transient attachments are cleared again as soon as
+    * the buffer is reused, so order those clears after the previous
+    * frame's writes. */
+   if (vc->depth || msaa) {
+      dependencies[dependency_count++] = (VkSubpassDependency) {
+         .srcSubpass = VK_SUBPASS_EXTERNAL,
+         .dstSubpass = 0,
+         .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                         VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+         .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+                         VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+         .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+         .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+                          VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+      };
+   }
+
+   /* The headless readback copies attachment 0 out with a transfer. The
+    * implicit dependency at the end of the render pass only reaches
+    * BOTTOM_OF_PIPE, so make the color writes, the msaa resolve and the
+    * final layout transition visible to transfer reads explicitly. */
+   dependencies[dependency_count++] = (VkSubpassDependency) {
+      .srcSubpass = 0,
+      .dstSubpass = VK_SUBPASS_EXTERNAL,
+      .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+   };
+
    vkCreateRenderPass(vc->device,
       &(VkRenderPassCreateInfo) {
          .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-         .attachmentCount = 1,
-         .pAttachments = (VkAttachmentDescription[]) {
-            {
-               .format = vc->image_format,
-               .samples = 1,
-               .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-               .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-               .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-               .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-            }
-         },
+         .attachmentCount = attachment_count,
+         .pAttachments = attachments,
          .subpassCount = 1,
          .pSubpasses = (VkSubpassDescription []) {
             {
@@ -239,44 +531,141 @@ init_vk_objects(struct vkcube *vc)
                .colorAttachmentCount = 1,
                .pColorAttachments = (VkAttachmentReference []) {
                   {
-                     .attachment = 0,
+                     .attachment = color_attachment,
                      .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
                   }
                },
                .pResolveAttachments = (VkAttachmentReference []) {
                   {
-                     .attachment = VK_ATTACHMENT_UNUSED,
+                     .attachment = msaa ? 0 : VK_ATTACHMENT_UNUSED,
                      .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
                   }
                },
-               .pDepthStencilAttachment = NULL,
+               .pDepthStencilAttachment = vc->depth ?
+                  &(VkAttachmentReference) {
+                     .attachment = depth_attachment,
+                     .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                  } : NULL,
                .preserveAttachmentCount = 0,
                .pPreserveAttachments = NULL,
             }
          },
-         .dependencyCount = 0
+         .dependencyCount = dependency_count,
+         .pDependencies = dependencies,
       },
       NULL,
       &vc->render_pass);
+   phase_mark(&vc->phases, "render_pass");
 
    vc->model.init(vc);
 
+   if (gpu_timing_interval >= 0)
+      gpu_timer_init(vc, gpu_timing_interval);
+   else
+      vc->gpu_timer = (struct gpu_timer) { .query_pool = VK_NULL_HANDLE };
+
+   if (vc->pipeline_statistics)
+      pipeline_stats_init(vc);
+   else
+      vc->pipeline_stats = (struct pipeline_stats) { .query_pool = VK_NULL_HANDLE };
+
    vkCreateCommandPool(vc->device,
                        &(const VkCommandPoolCreateInfo) {
                           .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-                          .queueFamilyIndex = 0,
+                          .queueFamilyIndex = vc->queue_family,
                           .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT |
                                    (vc->protected ? VK_COMMAND_POOL_CREATE_PROTECTED_BIT : 0)
                        },
                        NULL,
                        &vc->cmd_pool);
 
-   vkCreateSemaphore(vc->device,
-                     &(VkSemaphoreCreateInfo) {
-                        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+   if (vc->record_mode == RECORD_MODE_SECONDARY) {
+      vc->recorder = recorder_create(vc->record_threads);
+      printf("recording secondary command buffers on %u threads\n",
+             vc->record_threads);
+   }
+
+   init_frames(vc);
+}
+
+/* Creates a transient attachment: one that only lives inside the render
+ * pass, so it goes in lazily allocated memory where the device has it and
+ * may never be backed by real memory at all. Returns the size of its
+ * memory. */
+static VkDeviceSize
+create_transient_attachment(struct vkcube *vc, VkFormat format,
+                            VkImageUsageFlags usage,
+                            VkImageAspectFlags aspect, const char *name,
+                            bool report, VkImage *image,
+                            VkDeviceMemory *mem, VkImageView *view)
+{
+   vkCreateImage(vc->device,
+                 &(VkImageCreateInfo) {
+                    .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                    .imageType = VK_IMAGE_TYPE_2D,
+                    .format = format,
+                    .extent = { .width = vc->width, .height = vc->height, .depth = 1 },
+                    .mipLevels = 1,
+                    .arrayLayers = 1,
+                    .samples = vc->samples,
+                    .tiling = VK_IMAGE_TILING_OPTIMAL,
+                    .usage = usage | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT,
+                    .flags = vc->protected ? VK_IMAGE_CREATE_PROTECTED_BIT : 0,
+                 },
+                 NULL,
+                 image);
+
+   VkMemoryRequirements reqs;
+   vkGetImageMemoryRequirements(vc->device, *image, &reqs);
+
+   int memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                      vc->protected ? VK_MEMORY_PROPERTY_PROTECTED_BIT : 0,
+                                      VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+   fail_if(memory_type < 0, "no memory type for the %s", name);
+
+   if (report) {
+      VkMemoryPropertyFlags flags =
+         vc->memory_properties.memoryTypes[memory_type].propertyFlags;
+      printf("%s in %s memory, %.1f MiB per frame\n", name,
+             flags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT ?
+             "lazily allocated" : "regular", reqs.size / 1048576.0);
+   }
+
+   vkAllocateMemory(vc->device,
+                    &(VkMemoryAllocateInfo) {
+                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                       .allocationSize = reqs.size,
+                       .memoryTypeIndex = memory_type,
+                    },
+                    NULL,
+                    mem);
+   vkBindImageMemory(vc->device, *image, *mem, 0);
+
+   vkCreateImageView(vc->device,
+                     &(VkImageViewCreateInfo) {
+                        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                        .image = *image,
+                        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                        .format = format,
+                        .subresourceRange = {
+                           .aspectMask = aspect,
+                           .baseMipLevel = 0,
+                           .levelCount = 1,
+                           .baseArrayLayer = 0,
+                           .layerCount = 1,
+                        },
                      },
                      NULL,
-                     &vc->semaphore);
+                     view);
+
+   return reqs.size;
+}
+
+/* Primary command buffers per vkcube_buffer, see static_cmds. */
+static uint32_t
+static_cmd_count(struct vkcube *vc)
+{
+   return vc->record_mode == RECORD_MODE_STATIC ? vc->instance_orders : 1;
 }
 
 static void
@@ -305,12 +694,45 @@ init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
                      NULL,
                      &b->view);
 
+   /* Same order as the render pass attachments. */
+   VkImageView views[3];
+   uint32_t view_count = 0;
+   bool first = b == &vc->buffers[0];
+   bool report = first && !vc->transient_reported;
+   VkDeviceSize transient_bytes = 0;
+
+   views[view_count++] = b->view;
+   if (vc->samples > 1) {
+      transient_bytes +=
+         create_transient_attachment(vc, vc->image_format,
+                                     VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                                     VK_IMAGE_ASPECT_COLOR_BIT,
+                                     "multisampled color buffer", report,
+                                     &b->msaa_image, &b->msaa_mem,
+                                     &b->msaa_view);
+      views[view_count++] = b->msaa_view;
+   }
+   if (vc->depth) {
+      transient_bytes +=
+         create_transient_attachment(vc, depth_format,
+                                     VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                                     VK_IMAGE_ASPECT_DEPTH_BIT,
+                                     "depth buffer", report,
+                                     &b->depth_image, &b->depth_mem,
+                                     &b->depth_view);
+      views[view_count++] = b->depth_view;
+   }
+   if (first) {
+      vc->transient_bytes = transient_bytes;
+      vc->transient_reported = true;
+   }
+
    vkCreateFramebuffer(vc->device,
                        &(VkFramebufferCreateInfo) {
                           .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
                           .renderPass = vc->render_pass,
-                          .attachmentCount = 1,
-                          .pAttachments = &b->view,
+                          .attachmentCount = view_count,
+                          .pAttachments = views,
                           .width = vc->width,
                           .height = vc->height,
                           .layers = 1
@@ -325,82 +747,272 @@ init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
                  },
                  NULL,
                  &b->fence);
+   b->submit_time = 0;
+
+   if (vc->reset_pools) {
+      vkCreateCommandPool(vc->device,
+                          &(const VkCommandPoolCreateInfo) {
+                             .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                             .queueFamilyIndex = vc->queue_family,
+                             .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                                      (vc->protected ? VK_COMMAND_POOL_CREATE_PROTECTED_BIT : 0)
+                          },
+                          NULL,
+                          &b->cmd_pool);
+   } else {
+      b->cmd_pool = vc->cmd_pool;
+   }
 
    vkAllocateCommandBuffers(vc->device,
       &(VkCommandBufferAllocateInfo) {
          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-         .commandPool = vc->cmd_pool,
+         .commandPool = b->cmd_pool,
          .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-         .commandBufferCount = 1,
+         .commandBufferCount = static_cmd_count(vc),
       },
-      &b->cmd_buffer);
+      b->static_cmds);
+   b->cmd_buffer = b->static_cmds[0];
+
+   for (uint32_t i = 0; vc->record_mode == RECORD_MODE_SECONDARY &&
+                        i < vc->record_threads; i++) {
+      vkCreateCommandPool(vc->device,
+                          &(const VkCommandPoolCreateInfo) {
+                             .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+                             .queueFamilyIndex = vc->queue_family,
+                             .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                                      (vc->protected ? VK_COMMAND_POOL_CREATE_PROTECTED_BIT : 0)
+                          },
+                          NULL,
+                          &b->secondary_pools[i]);
+
+      vkAllocateCommandBuffers(vc->device,
+         &(VkCommandBufferAllocateInfo) {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = b->secondary_pools[i],
+            .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+            .commandBufferCount = 1,
+         },
+         &b->secondary_cmds[i]);
+   }
+
+   b->render_semaphore = VK_NULL_HANDLE;
+   b->recorded = 0;
+   b->timestamps_pending = false;
+   b->stats_pending = false;
 }
 
 /* Headless code - write one frame to png */
 
+/* Rendered images are read back by copying them into a buffer in host
+ * cached memory, where the CPU reads at full speed, instead of mapping the
+ * image memory itself, which is typically write-combined or uncached. The
+ * copy is its own submission, so only frames that are read back pay for
+ * it. */
 static void
-convert_to_bytes(png_structp png, png_row_infop row_info, png_bytep data)
+init_readback(struct vkcube *vc, struct vkcube_buffer *b)
 {
-   for (uint32_t i = 0; i < row_info->rowbytes; i += 4) {
-      uint8_t *b = &data[i];
-      uint32_t pixel;
+   VkDeviceSize size = (VkDeviceSize) vc->width * vc->height * 4;
 
-      memcpy (&pixel, b, sizeof (uint32_t));
-      b[0] = (pixel & 0xff0000) >> 16;
-      b[1] = (pixel & 0x00ff00) >>  8;
-      b[2] = (pixel & 0x0000ff) >>  0;
-      b[3] = 0xff;
-   }
+   fail_if(vc->protected, "protected content can't be read back");
+
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = size,
+                     .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                  },
+                  NULL,
+                  &b->readback_buffer);
+
+   VkMemoryRequirements reqs;
+   vkGetBufferMemoryRequirements(vc->device, b->readback_buffer, &reqs);
+
+   int memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                      VK_MEMORY_PROPERTY_HOST_CACHED_BIT, 0);
+   if (memory_type < 0)
+      memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 0);
+   fail_if(memory_type < 0, "no host visible memory for readback");
+
+   VkMemoryPropertyFlags flags =
+      vc->memory_properties.memoryTypes[memory_type].propertyFlags;
+   b->readback_coherent = flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+   b->readback_size = reqs.size;
+
+   vkAllocateMemory(vc->device,
+                    &(VkMemoryAllocateInfo) {
+                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                       .allocationSize = reqs.size,
+                       .memoryTypeIndex = memory_type,
+                    },
+                    NULL,
+                    &b->readback_mem);
+   vkBindBufferMemory(vc->device, b->readback_buffer, b->readback_mem, 0);
+   vkMapMemory(vc->device, b->readback_mem, 0, VK_WHOLE_SIZE, 0,
+               &b->readback_map);
+
+   vkCreateFence(vc->device,
+                 &(VkFenceCreateInfo) {
+                    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                 },
+                 NULL,
+                 &b->readback_fence);
+   b->readback_pending = false;
+
+   vkAllocateCommandBuffers(vc->device,
+      &(VkCommandBufferAllocateInfo) {
+         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+         .commandPool = vc->cmd_pool,
+         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+         .commandBufferCount = 1,
+      },
+      &b->readback_cmd);
+
+   /* The copy never changes, so record it once. The render pass ends with
+    * a dependency into the transfer stage, see init_vk_objects(), and
+    * submission order carries it into this command buffer. Starting the
+    * barrier at the transfer stage chains the layout transition after it. */
+   vkBeginCommandBuffer(b->readback_cmd,
+                        &(VkCommandBufferBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                        });
+
+   vkCmdPipelineBarrier(b->readback_cmd,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        0, 0, NULL, 0, NULL, 1,
+                        &(VkImageMemoryBarrier) {
+                           .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                           .srcAccessMask = 0,
+                           .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+                           .oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+                           .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .image = b->image,
+                           .subresourceRange = {
+                              .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                              .levelCount = 1,
+                              .layerCount = 1,
+                           },
+                        });
+
+   vkCmdCopyImageToBuffer(b->readback_cmd, b->image,
+                          VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                          b->readback_buffer, 1,
+                          &(VkBufferImageCopy) {
+                             .bufferOffset = 0,
+                             .bufferRowLength = 0,
+                             .bufferImageHeight = 0,
+                             .imageSubresource = {
+                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                .layerCount = 1,
+                             },
+                             .imageExtent = { vc->width, vc->height, 1 },
+                          });
+
+   vkCmdPipelineBarrier(b->readback_cmd,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_HOST_BIT,
+                        0, 0, NULL, 1,
+                        &(VkBufferMemoryBarrier) {
+                           .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                           .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+                           .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .buffer = b->readback_buffer,
+                           .offset = 0,
+                           .size = VK_WHOLE_SIZE,
+                        }, 0, NULL);
+
+   vkEndCommandBuffer(b->readback_cmd);
 }
 
+/* Queues the copy of b's image, right behind the render that fills it. */
 static void
-write_png(const char *path, int32_t width, int32_t height, int32_t stride, void *pixels)
+readback_submit(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   vkQueueSubmit(vc->queue, 1,
+      &(VkSubmitInfo) {
+         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+         .commandBufferCount = 1,
+         .pCommandBuffers = &b->readback_cmd,
+      }, b->readback_fence);
+   b->readback_pending = true;
+}
+
+/* Waits for the copy and returns the pixels, packed at width * 4 bytes per
+ * row. Non-coherent memory is invalidated over just the image's bytes,
+ * rounded out to nonCoherentAtomSize. */
+static void *
+readback_finish(struct vkcube *vc, struct vkcube_buffer *b)
 {
-   FILE *f = NULL;
-   png_structp png_writer = NULL;
-   png_infop png_info = NULL;
+   if (b->readback_pending) {
+      vkWaitForFences(vc->device, 1, &b->readback_fence, VK_TRUE, UINT64_MAX);
+      vkResetFences(vc->device, 1, &b->readback_fence);
+      b->readback_pending = false;
+   }
 
-   uint8_t *rows[height];
+   if (!b->readback_coherent) {
+      VkDeviceSize atom = vc->properties.limits.nonCoherentAtomSize;
+      VkDeviceSize size = (VkDeviceSize) vc->width * vc->height * 4;
 
-   for (int32_t y = 0; y < height; y++)
-      rows[y] = pixels + y * stride;
+      size = atom ? (size + atom - 1) / atom * atom : size;
+      if (size > b->readback_size)
+         size = VK_WHOLE_SIZE;
 
-   f = fopen(path, "wb");
-   fail_if(!f, "failed to open file for writing: %s", path);
+      vkInvalidateMappedMemoryRanges(vc->device, 1,
+         &(VkMappedMemoryRange) {
+            .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+            .memory = b->readback_mem,
+            .offset = 0,
+            .size = size,
+         });
+   }
 
-   png_writer = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                        NULL, NULL, NULL);
-   fail_if (!png_writer, "failed to create png writer");
+   return b->readback_map;
+}
 
-   png_info = png_create_info_struct(png_writer);
-   fail_if(!png_info, "failed to create png writer info");
+/* Opens the -o file, or the saved stdout, as a raw, ppm or y4m stream. */
+static struct output *
+open_output(struct vkcube *vc)
+{
+   uint32_t fps_num = 60, fps_den = 1;
+   int fd = output_fd;
 
-   png_init_io(png_writer, f);
-   png_set_IHDR(png_writer, png_info,
-                width, height,
-                8, PNG_COLOR_TYPE_RGBA,
-                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                PNG_FILTER_TYPE_DEFAULT);
-   png_write_info(png_writer, png_info);
-   png_set_rows(png_writer, png_info, rows);
-   png_set_write_user_transform_fn(png_writer, convert_to_bytes);
-   png_write_png(png_writer, png_info, PNG_TRANSFORM_IDENTITY, NULL);
+   if (fd < 0) {
+      fd = open(arg_out_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      fail_if(fd < 0, "failed to open %s: %m", arg_out_file);
+   }
 
-   png_destroy_write_struct(&png_writer, &png_info);
+   if (time_step_ms > 0) {
+      fps_num = 1000000;
+      fps_den = time_step_ms * 1000 + 0.5;
+   }
 
-   fclose(f);
+   return output_open(output_format, fd, vc->width, vc->height,
+                      fps_num, fps_den);
 }
 
 static void
 write_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 {
    const char *filename = arg_out_file;
-   uint32_t mem_size = b->stride * vc->height;
-   void *map;
-
-   vkMapMemory(vc->device, b->mem, 0, mem_size, 0, &map);
+   void *map = readback_finish(vc, b);
 
    fprintf(stderr, "writing first frame to %s\n", filename);
+
+   if (output_format != OUTPUT_FORMAT_PNG) {
+      struct output *o = open_output(vc);
+      output_write_frame(o, map, b->stride);
+      output_close(o);
+      return;
+   }
+
+   swizzle_bgra_to_rgba(map, map, vc->width * vc->height);
    write_png(filename, vc->width, vc->height, b->stride, map);
 }
 
@@ -408,49 +1020,269 @@ write_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 static int
 init_headless(struct vkcube *vc)
 {
-   init_vk(vc, NULL);
+   init_vk(vc, NULL, NULL);
    vc->image_format = VK_FORMAT_B8G8R8A8_SRGB;
    init_vk_objects(vc);
 
-   struct vkcube_buffer *b = &vc->buffers[0];
-
-   vkCreateImage(vc->device,
-                 &(VkImageCreateInfo) {
-                    .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-                    .imageType = VK_IMAGE_TYPE_2D,
-                    .format = vc->image_format,
-                    .extent = { .width = vc->width, .height = vc->height, .depth = 1 },
-                    .mipLevels = 1,
-                    .arrayLayers = 1,
-                    .samples = 1,
-                    .tiling = VK_IMAGE_TILING_LINEAR,
-                    .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-                    .flags = vc->protected ? VK_IMAGE_CREATE_PROTECTED_BIT : 0,
-                 },
-                 NULL,
-                 &b->image);
+   /* A single frame only needs one image. When benchmarking, rotate through
+    * a ring of frames_in_flight images so the CPU can record the next frame
+    * while the GPU is still busy with the previous ones. */
+   if (bench_frames == 0 && bench_seconds == 0)
+      vc->image_count = 1;
+   else
+      vc->image_count = vc->frames_in_flight;
 
-   VkMemoryRequirements requirements;
-   vkGetImageMemoryRequirements(vc->device, b->image, &requirements);
+   /* Render into optimally tiled, device local images. Only frames that are
+    * written out get copied to a linear buffer, see init_readback(), so
+    * benchmark runs never render to linear memory. */
+   for (uint32_t i = 0; i < vc->image_count; i++) {
+      struct vkcube_buffer *b = &vc->buffers[i];
 
-   vkAllocateMemory(vc->device,
-                    &(VkMemoryAllocateInfo) {
-                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                       .allocationSize = requirements.size,
-                       .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits),
+      vkCreateImage(vc->device,
+                    &(VkImageCreateInfo) {
+                       .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+                       .imageType = VK_IMAGE_TYPE_2D,
+                       .format = vc->image_format,
+                       .extent = { .width = vc->width, .height = vc->height, .depth = 1 },
+                       .mipLevels = 1,
+                       .arrayLayers = 1,
+                       .samples = 1,
+                       .tiling = VK_IMAGE_TILING_OPTIMAL,
+                       .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                                VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                       .flags = vc->protected ? VK_IMAGE_CREATE_PROTECTED_BIT : 0,
                     },
                     NULL,
-                    &b->mem);
+                    &b->image);
+
+      VkMemoryRequirements requirements;
+      vkGetImageMemoryRequirements(vc->device, b->image, &requirements);
+
+      vkAllocateMemory(vc->device,
+                       &(VkMemoryAllocateInfo) {
+                          .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                          .allocationSize = requirements.size,
+                          .memoryTypeIndex = find_image_memory(vc, requirements.memoryTypeBits),
+                       },
+                       NULL,
+                       &b->mem);
 
-   vkBindImageMemory(vc->device, b->image, b->mem, 0);
+      vkBindImageMemory(vc->device, b->image, b->mem, 0);
 
-   b->stride = vc->width * 4;
+      /* The stride of the readback buffer; the image itself has none. */
+      b->stride = vc->width * 4;
 
-   init_buffer(vc, &vc->buffers[0]);
+      init_buffer(vc, b);
+
+      /* Benchmark runs without -i never read a frame back, so they skip
+       * the readback buffers, which also lets them render protected
+       * content. */
+      if ((bench_frames == 0 && bench_seconds == 0) || capture_interval > 0)
+         init_readback(vc, b);
+   }
+   phase_mark(&vc->phases, "images");
 
    return 0;
 }
 
+/* Wait up to timeout ns for b to complete and record its submit-to-complete
+ * latency. */
+static void
+retire_buffer(struct vkcube *vc, struct vkcube_buffer *b,
+              struct bench_stats *gpu, uint64_t timeout)
+{
+   if (b->submit_time == 0)
+      return;
+
+   if (vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, timeout) != VK_SUCCESS)
+      return;
+
+   bench_stats_add(gpu, get_time_ns() - b->submit_time);
+   b->submit_time = 0;
+
+   /* The queue completes frames in order, so the first retired buffer is
+    * the first frame, which ends startup timing. */
+   phase_mark(&vc->phases, "first_frame");
+   phase_finish(&vc->phases);
+}
+
+/* Reads one word per cache line, so the readback time includes pulling
+ * the pixels into the CPU's caches, but not what is done with them. */
+static void
+touch_pixels(const void *map, size_t size)
+{
+   const volatile uint64_t *p = map;
+   uint64_t sum = 0;
+
+   for (size_t i = 0; i < size / sizeof(*p); i += 64 / sizeof(*p))
+      sum += p[i];
+   (void) sum;
+}
+
+/* Hands the completed frame in b to the PNG capture workers, or appends
+ * it to the output stream. */
+static void
+capture_buffer(struct vkcube *vc, struct capture *c, struct output *stream,
+               struct vkcube_buffer *b, uint32_t frame)
+{
+   char path[32];
+   size_t size = (size_t) b->stride * vc->height;
+   uint64_t start = get_time_ns();
+   void *map = readback_finish(vc, b);
+
+   touch_pixels(map, size);
+   uint64_t ready = get_time_ns();
+
+   if (stream) {
+      output_write_frame(stream, map, b->stride);
+   } else {
+      snprintf(path, sizeof(path), "cube-%05u.png", frame);
+      capture_frame(c, map, b->stride, path);
+   }
+
+   vc->readback_bytes += size;
+   vc->readback_ns += ready - start;
+   vc->output_ns += get_time_ns() - ready;
+}
+
+static void
+mainloop_headless(struct vkcube *vc)
+{
+   if (bench_frames == 0 && bench_seconds == 0) {
+      vc->model.render(vc, &vc->buffers[0], VK_NULL_HANDLE, VK_NULL_HANDLE);
+      phase_mark(&vc->phases, "first_submit");
+      readback_submit(vc, &vc->buffers[0]);
+      vkQueueWaitIdle(vc->queue);
+      phase_mark(&vc->phases, "first_frame");
+      phase_finish(&vc->phases);
+      write_buffer(vc, &vc->buffers[0]);
+      return;
+   }
+
+   struct bench_stats cpu = { 0 }, gpu = { 0 };
+   struct capture *capture = NULL;
+   struct output *stream = NULL;
+   int64_t capture_pending[MAX_NUM_IMAGES];
+
+   if (capture_interval > 0 && output_format == OUTPUT_FORMAT_PNG) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      uint32_t workers = cpus > 1 ? (cpus - 1 < 8 ? cpus - 1 : 8) : 1;
+
+      capture = capture_create(vc->width, vc->height, workers);
+   } else if (capture_interval > 0) {
+      stream = open_output(vc);
+   }
+
+   for (uint32_t i = 0; i < vc->image_count; i++)
+      capture_pending[i] = -1;
+
+   vc->readback_bytes = 0;
+   vc->readback_ns = 0;
+   vc->output_ns = 0;
+
+   uint64_t start = get_time_ns();
+   uint64_t end = start + (uint64_t) (bench_seconds * 1e9);
+   uint32_t frames;
+
+   for (frames = 0; ; frames++) {
+      if (bench_frames > 0 && frames == bench_frames)
+         break;
+      if (bench_seconds > 0 && get_time_ns() >= end)
+         break;
+
+      uint32_t index = frames % vc->image_count;
+      struct vkcube_buffer *b = &vc->buffers[index];
+      retire_buffer(vc, b, &gpu, UINT64_MAX);
+
+      if (capture_interval > 0) {
+         if (capture_pending[index] >= 0)
+            capture_buffer(vc, capture, stream, b, capture_pending[index]);
+         capture_pending[index] =
+            frames % capture_interval == 0 ? frames : -1;
+      }
+
+      uint64_t t0 = get_time_ns();
+      vc->model.render(vc, b, VK_NULL_HANDLE, VK_NULL_HANDLE);
+      uint64_t t1 = get_time_ns();
+      if (frames == 0)
+         phase_mark(&vc->phases, "first_submit");
+
+      if (capture_interval > 0 && capture_pending[index] >= 0)
+         readback_submit(vc, b);
+
+      b->submit_time = t1;
+      bench_stats_add(&cpu, t1 - t0);
+
+      /* Pick up anything that finished meanwhile, without blocking. */
+      for (uint32_t i = 0; i < vc->image_count; i++)
+         retire_buffer(vc, &vc->buffers[i], &gpu, 0);
+   }
+
+   for (uint32_t i = 0; i < vc->image_count; i++)
+      retire_buffer(vc, &vc->buffers[i], &gpu, UINT64_MAX);
+
+   /* Oldest first, so streams stay in frame order. */
+   for (uint32_t i = 0; i < vc->image_count; i++) {
+      uint32_t index = (frames + i) % vc->image_count;
+      if (capture_pending[index] >= 0)
+         capture_buffer(vc, capture, stream, &vc->buffers[index],
+                        capture_pending[index]);
+   }
+
+   uint64_t elapsed = get_time_ns() - start;
+   vc->bench_frames_done = frames;
+   vc->bench_elapsed = elapsed;
+
+   static const char *record_mode_names[] = {
+      [RECORD_MODE_DYNAMIC] = "dynamic",
+      [RECORD_MODE_STATIC] = "static",
+      [RECORD_MODE_SECONDARY] = "secondary",
+   };
+   printf("%u frames in %.3f s, %.1f fps (%s command buffers",
+          frames, elapsed / 1e9, frames * 1e9 / elapsed,
+          record_mode_names[vc->record_mode]);
+   if (vc->record_mode == RECORD_MODE_SECONDARY)
+      printf(", %u recording threads", vc->record_threads);
+   if (vc->draw_count > 1)
+      printf(", %u draws", vc->draw_count);
+   if (vc->reset_pools)
+      printf(", per-frame pools");
+   if (vc->samples > 1)
+      printf(", %ux msaa", vc->samples);
+   printf(")\n");
+   bench_stats_print(&cpu, "cpu frame time:");
+   bench_stats_print(&gpu, "gpu complete latency:");
+   /* What the transient attachments would cost in bandwidth at this frame
+    * rate if each frame's were written out once, which is the traffic that
+    * lazily allocated memory saves. */
+   if (vc->transient_bytes > 0) {
+      double mib = vc->transient_bytes / 1048576.0;
+      printf("transient attachments: %.1f MiB per frame, %.1f MiB/s\n",
+             mib, mib * frames * 1e9 / elapsed);
+   }
+   if (vc->instanced) {
+      double instances = (double) frames * vc->instance_count;
+      printf("%.3f M instances/s, %.3f M triangles/s\n",
+             instances / elapsed * 1e3,
+             instances * vc->triangle_count / elapsed * 1e3);
+   }
+   if (vc->readback_bytes > 0) {
+      printf("readback: %.1f MiB in %.3f s, %.1f MiB/s\n",
+             vc->readback_bytes / 1048576.0, vc->readback_ns / 1e9,
+             vc->readback_bytes / 1048576.0 / (vc->readback_ns / 1e9));
+      printf("output: %.3f s handing frames to the %s\n",
+             vc->output_ns / 1e9, stream ? "output stream" : "png workers");
+   }
+
+   bench_stats_finish(&cpu);
+   bench_stats_finish(&gpu);
+
+   if (capture)
+      capture_destroy(capture);
+   if (stream)
+      output_close(stream);
+}
+
 #ifdef HAVE_VULKAN_INTEL_H
 
 /* KMS display code - render to kernel modesetting fb */
@@ -566,14 +1398,15 @@ init_kms(struct vkcube *vc)
 
    vc->gbm_device = gbm_create_device(vc->fd);
 
-   init_vk(vc, NULL);
+   init_vk(vc, NULL, NULL);
    vc->image_format = VK_FORMAT_R8G8B8A8_SRGB;
    init_vk_objects(vc);
 
    PFN_vkCreateDmaBufImageINTEL create_dma_buf_image =
       (PFN_vkCreateDmaBufImageINTEL)vkGetDeviceProcAddr(vc->device, "vkCreateDmaBufImageINTEL");
 
-   for (uint32_t i = 0; i < 2; i++) {
+   vc->image_count = 2;
+   for (uint32_t i = 0; i < vc->image_count; i++) {
       struct vkcube_buffer *b = &vc->buffers[i];
       int fd, stride, ret;
 
@@ -606,6 +1439,7 @@ init_kms(struct vkcube *vc)
 
       init_buffer(vc, b);
    }
+   phase_mark(&vc->phases, "images");
 
    return 0;
 }
@@ -659,11 +1493,14 @@ mainloop_vt(struct vkcube *vc)
       if (pfd[1].revents & POLLIN) {
          drmHandleEvent(vc->fd, &evctx);
          b = &vc->buffers[vc->current & 1];
-         vc->model.render(vc, b, false);
+         vc->model.render(vc, b, VK_NULL_HANDLE, VK_NULL_HANDLE);
+         phase_mark(&vc->phases, "first_submit");
 
          ret = drmModePageFlip(vc->fd, vc->crtc->crtc_id, b->fb,
                                DRM_MODE_PAGE_FLIP_EVENT, NULL);
          fail_if(ret < 0, "pageflip failed: %m\n");
+         phase_mark(&vc->phases, "first_present");
+         phase_finish(&vc->phases);
          vc->current++;
       }
    }
@@ -739,9 +1576,10 @@ create_swapchain(struct vkcube *vc)
           VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR);
 
    VkBool32 supported;
-   vkGetPhysicalDeviceSurfaceSupportKHR(vc->physical_device, 0, vc->surface,
-                                        &supported);
-   assert(supported);
+   vkGetPhysicalDeviceSurfaceSupportKHR(vc->physical_device, vc->queue_family,
+                                        vc->surface, &supported);
+   fail_if(!supported, "queue family %u can't present to the surface",
+           vc->queue_family);
 
    uint32_t count;
    vkGetPhysicalDeviceSurfacePresentModesKHR(vc->physical_device, vc->surface,
@@ -784,7 +1622,7 @@ create_swapchain(struct vkcube *vc)
          .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
          .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
          .queueFamilyIndexCount = 1,
-         .pQueueFamilyIndices = (uint32_t[]) { 0 },
+         .pQueueFamilyIndices = (uint32_t[]) { vc->queue_family },
          .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
          .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
          .presentMode = present_mode,
@@ -801,7 +1639,97 @@ create_swapchain(struct vkcube *vc)
    for (uint32_t i = 0; i < vc->image_count; i++) {
       vc->buffers[i].image = swap_chain_images[i];
       init_buffer(vc, &vc->buffers[i]);
+      vc->buffers[i].render_semaphore = create_semaphore(vc);
+   }
+   phase_mark(&vc->phases, "swapchain");
+}
+
+#if defined(ENABLE_XCB) || defined(ENABLE_WAYLAND)
+
+static void
+fini_buffer(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   vkFreeCommandBuffers(vc->device, b->cmd_pool, static_cmd_count(vc),
+                        b->static_cmds);
+   if (b->cmd_pool != vc->cmd_pool)
+      vkDestroyCommandPool(vc->device, b->cmd_pool, NULL);
+   for (uint32_t i = 0; vc->record_mode == RECORD_MODE_SECONDARY &&
+                        i < vc->record_threads; i++)
+      vkDestroyCommandPool(vc->device, b->secondary_pools[i], NULL);
+   vkDestroyFence(vc->device, b->fence, NULL);
+   vkDestroyFramebuffer(vc->device, b->framebuffer, NULL);
+   vkDestroyImageView(vc->device, b->view, NULL);
+   if (vc->samples > 1) {
+      vkDestroyImageView(vc->device, b->msaa_view, NULL);
+      vkDestroyImage(vc->device, b->msaa_image, NULL);
+      vkFreeMemory(vc->device, b->msaa_mem, NULL);
    }
+   if (vc->depth) {
+      vkDestroyImageView(vc->device, b->depth_view, NULL);
+      vkDestroyImage(vc->device, b->depth_image, NULL);
+      vkFreeMemory(vc->device, b->depth_mem, NULL);
+   }
+   if (b->render_semaphore != VK_NULL_HANDLE)
+      vkDestroySemaphore(vc->device, b->render_semaphore, NULL);
+}
+
+static void
+destroy_swapchain(struct vkcube *vc)
+{
+   /* Images and semaphores may still be in use by the GPU. */
+   vkDeviceWaitIdle(vc->device);
+
+   for (uint32_t i = 0; i < vc->frames_in_flight; i++)
+      vc->frames[i].buffer = NULL;
+
+   for (uint32_t i = 0; i < vc->image_count; i++)
+      fini_buffer(vc, &vc->buffers[i]);
+
+   vkDestroySwapchainKHR(vc->device, vc->swap_chain, NULL);
+   vc->image_count = 0;
+}
+
+#endif
+
+/* Pick the next frame slot, waiting until the GPU is done with the frame
+ * that last used it. This is what bounds how far the CPU runs ahead. */
+static struct vkcube_frame *
+begin_frame(struct vkcube *vc)
+{
+   struct vkcube_frame *f = &vc->frames[vc->frame_index % vc->frames_in_flight];
+
+   if (f->buffer)
+      vkWaitForFences(vc->device, 1, &f->buffer->fence, VK_TRUE, UINT64_MAX);
+
+   return f;
+}
+
+static VkResult
+render_and_present(struct vkcube *vc, struct vkcube_frame *f, uint32_t index)
+{
+   struct vkcube_buffer *b = &vc->buffers[index];
+   VkResult result;
+
+   assert(index < MAX_NUM_IMAGES);
+   vc->model.render(vc, b, f->acquire_semaphore, b->render_semaphore);
+   phase_mark(&vc->phases, "first_submit");
+   f->buffer = b;
+   vc->frame_index++;
+
+   vkQueuePresentKHR(vc->queue,
+      &(VkPresentInfoKHR) {
+         .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+         .waitSemaphoreCount = 1,
+         .pWaitSemaphores = &b->render_semaphore,
+         .swapchainCount = 1,
+         .pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
+         .pImageIndices = (uint32_t[]) { index, },
+         .pResults = &result,
+      });
+   phase_mark(&vc->phases, "first_present");
+   phase_finish(&vc->phases);
+
+   return result;
 }
 
 /* XCB display code - render to X window */
@@ -825,6 +1753,20 @@ get_atom(struct xcb_connection_t *conn, const char *name)
    return atom;
 }
 
+static bool
+xcb_present_support(struct vkcube *vc, uint32_t queue_family)
+{
+   PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR get_xcb_presentation_support =
+      (PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR)
+      vkGetInstanceProcAddr(vc->instance, "vkGetPhysicalDeviceXcbPresentationSupportKHR");
+   xcb_screen_iterator_t iter =
+      xcb_setup_roots_iterator(xcb_get_setup(vc->xcb.conn));
+
+   return get_xcb_presentation_support(vc->physical_device, queue_family,
+                                       vc->xcb.conn,
+                                       iter.data->root_visual);
+}
+
 // Return -1 on failure.
 static int
 init_xcb(struct vkcube *vc)
@@ -880,21 +1822,12 @@ init_xcb(struct vkcube *vc)
 
    xcb_flush(vc->xcb.conn);
 
-   init_vk(vc, VK_KHR_XCB_SURFACE_EXTENSION_NAME);
+   init_vk(vc, VK_KHR_XCB_SURFACE_EXTENSION_NAME, xcb_present_support);
 
-   PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR get_xcb_presentation_support =
-      (PFN_vkGetPhysicalDeviceXcbPresentationSupportKHR)
-      vkGetInstanceProcAddr(vc->instance, "vkGetPhysicalDeviceXcbPresentationSupportKHR");
    PFN_vkCreateXcbSurfaceKHR create_xcb_surface =
       (PFN_vkCreateXcbSurfaceKHR)
       vkGetInstanceProcAddr(vc->instance, "vkCreateXcbSurfaceKHR");
 
-   if (!get_xcb_presentation_support(vc->physical_device, 0,
-                                     vc->xcb.conn,
-                                     iter.data->root_visual)) {
-      fail("Vulkan not supported on given X window");
-   }
-
    create_xcb_surface(vc->instance,
       &(VkXcbSurfaceCreateInfoKHR) {
          .sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR,
@@ -946,7 +1879,8 @@ mainloop_xcb(struct vkcube *vc)
 
             if (client_message->type == vc->xcb.atom_wm_protocols &&
                 client_message->data.data32[0] == vc->xcb.atom_wm_delete_window) {
-               exit(0);
+               free(event);
+               return;
             }
 
             if (client_message->type == XCB_ATOM_NOTICE)
@@ -957,10 +1891,8 @@ mainloop_xcb(struct vkcube *vc)
             configure = (xcb_configure_notify_event_t *) event;
             if (vc->width != configure->width ||
                 vc->height != configure->height) {
-               if (vc->image_count > 0) {
-                  vkDestroySwapchainKHR(vc->device, vc->swap_chain, NULL);
-                  vc->image_count = 0;
-               }
+               if (vc->image_count > 0)
+                  destroy_swapchain(vc);
 
                vc->width = configure->width;
                vc->height = configure->height;
@@ -974,8 +1906,10 @@ mainloop_xcb(struct vkcube *vc)
          case XCB_KEY_PRESS:
             key_press = (xcb_key_press_event_t *) event;
 
-            if (key_press->detail == 9)
-               exit(0);
+            if (key_press->detail == 9) {
+               free(event);
+               return;
+            }
 
             break;
          }
@@ -985,15 +1919,21 @@ mainloop_xcb(struct vkcube *vc)
       }
 
       if (repaint) {
-         if (vc->image_count == 0)
+         if (vc->image_count == 0) {
+            /* Don't charge the wait for the window to be mapped to the
+             * swapchain phase. */
+            phase_mark(&vc->phases, "window_map");
             create_swapchain(vc);
+         }
 
+         struct vkcube_frame *f = begin_frame(vc);
          uint32_t index;
          VkResult result;
          result = vkAcquireNextImageKHR(vc->device, vc->swap_chain, 60,
-                                        vc->semaphore, VK_NULL_HANDLE, &index);
+                                        f->acquire_semaphore, VK_NULL_HANDLE, &index);
          switch (result) {
          case VK_SUCCESS:
+         case VK_SUBOPTIMAL_KHR: /* still presentable, resize comes as event */
             break;
          case VK_NOT_READY: /* try later */
          case VK_TIMEOUT:   /* try later */
@@ -1004,19 +1944,7 @@ mainloop_xcb(struct vkcube *vc)
             return;
          }
 
-         assert(index <= MAX_NUM_IMAGES);
-         vc->model.render(vc, &vc->buffers[index], true);
-
-         vkQueuePresentKHR(vc->queue,
-             &(VkPresentInfoKHR) {
-                .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-                .swapchainCount = 1,
-                .pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
-                .pImageIndices = (uint32_t[]) { index, },
-                .pResults = &result,
-             });
-
-         vkQueueWaitIdle(vc->queue);
+         render_and_present(vc, f, index);
 
          schedule_xcb_repaint(vc);
       }
@@ -1098,8 +2026,10 @@ handle_wl_keyboard_key(void *data, struct wl_keyboard *wl_keyboard,
 		       uint32_t serial, uint32_t time, uint32_t key,
 		       uint32_t state)
 {
-    if (key == KEY_ESC && state == WL_KEYBOARD_KEY_STATE_PRESSED)
-      exit(0);
+   struct vkcube *vc = data;
+
+   if (key == KEY_ESC && state == WL_KEYBOARD_KEY_STATE_PRESSED)
+      vc->wl.quit = true;
 }
 
 static void
@@ -1173,6 +2103,17 @@ static const struct wl_registry_listener registry_listener = {
    registry_handle_global_remove
 };
 
+static bool
+wayland_present_support(struct vkcube *vc, uint32_t queue_family)
+{
+   PFN_vkGetPhysicalDeviceWaylandPresentationSupportKHR get_wayland_presentation_support =
+      (PFN_vkGetPhysicalDeviceWaylandPresentationSupportKHR)
+      vkGetInstanceProcAddr(vc->instance, "vkGetPhysicalDeviceWaylandPresentationSupportKHR");
+
+   return get_wayland_presentation_support(vc->physical_device, queue_family,
+                                           vc->wl.display);
+}
+
 // Return -1 on failure.
 static int
 init_wayland(struct vkcube *vc)
@@ -1211,20 +2152,12 @@ init_wayland(struct vkcube *vc)
    vc->wl.wait_for_configure = true;
    wl_surface_commit(vc->wl.surface);
 
-   init_vk(vc, VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME);
+   init_vk(vc, VK_KHR_WAYLAND_SURFACE_EXTENSION_NAME, wayland_present_support);
 
-   PFN_vkGetPhysicalDeviceWaylandPresentationSupportKHR get_wayland_presentation_support =
-      (PFN_vkGetPhysicalDeviceWaylandPresentationSupportKHR)
-      vkGetInstanceProcAddr(vc->instance, "vkGetPhysicalDeviceWaylandPresentationSupportKHR");
    PFN_vkCreateWaylandSurfaceKHR create_wayland_surface =
       (PFN_vkCreateWaylandSurfaceKHR)
       vkGetInstanceProcAddr(vc->instance, "vkCreateWaylandSurfaceKHR");
 
-   if (!get_wayland_presentation_support(vc->physical_device, 0,
-                                         vc->wl.display)) {
-      fail("Vulkan not supported on given Wayland surface");
-   }
-
    create_wayland_surface(vc->instance,
                           &(VkWaylandSurfaceCreateInfoKHR) {
          .sType = VK_STRUCTURE_TYPE_WAYLAND_SURFACE_CREATE_INFO_KHR,
@@ -1241,24 +2174,10 @@ init_wayland(struct vkcube *vc)
    return 0;
 }
 
-static void
-fini_buffer(struct vkcube *vc, struct vkcube_buffer *b)
-{
-   vkFreeCommandBuffers(vc->device, vc->cmd_pool, 1, &b->cmd_buffer);
-   vkDestroyFence(vc->device, b->fence, NULL);
-   vkDestroyFramebuffer(vc->device, b->framebuffer, NULL);
-   vkDestroyImageView(vc->device, b->view, NULL);
-}
-
 static void
 recreate_swapchain(struct vkcube *vc)
 {
-   VkSwapchainKHR old_chain = vc->swap_chain;
-
-   for (uint32_t i = 0; i < vc->image_count; i++)
-      fini_buffer(vc, &vc->buffers[i]);
-
-   vkDestroySwapchainKHR(vc->device, old_chain, NULL);
+   destroy_swapchain(vc);
    create_swapchain(vc);
 }
 
@@ -1269,7 +2188,7 @@ mainloop_wayland(struct vkcube *vc)
    struct pollfd fds[] = {
       { wl_display_get_fd(vc->wl.display), POLLIN },
    };
-   while (1) {
+   while (!vc->wl.quit) {
       uint32_t index;
 
       while (wl_display_prepare_read(vc->wl.display) != 0)
@@ -1285,34 +2204,28 @@ mainloop_wayland(struct vkcube *vc)
          wl_display_cancel_read(vc->wl.display);
       }
 
+      struct vkcube_frame *f = begin_frame(vc);
       result = vkAcquireNextImageKHR(vc->device, vc->swap_chain, 60,
-                                     vc->semaphore, VK_NULL_HANDLE, &index);
-      if (result == VK_SUBOPTIMAL_KHR ||
-          result == VK_ERROR_OUT_OF_DATE_KHR) {
+                                     f->acquire_semaphore, VK_NULL_HANDLE, &index);
+      if (result == VK_ERROR_OUT_OF_DATE_KHR) {
          recreate_swapchain(vc);
          continue;
       } else if (result == VK_NOT_READY ||
                  result == VK_TIMEOUT) {
          continue;
-      } else if (result != VK_SUCCESS) {
+      } else if (result != VK_SUCCESS &&
+                 result != VK_SUBOPTIMAL_KHR) {
          return;
       }
 
-      assert(index <= MAX_NUM_IMAGES);
-      vc->model.render(vc, &vc->buffers[index], true);
-
-      vkQueuePresentKHR(vc->queue,
-         &(VkPresentInfoKHR) {
-            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-            .swapchainCount = 1,
-            .pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
-            .pImageIndices = (uint32_t[]) { index, },
-            .pResults = &result,
-         });
-      if (result != VK_SUCCESS)
+      /* A suboptimal acquire has still signaled the acquire semaphore, so
+       * present this image and recreate the swapchain afterwards. */
+      result = render_and_present(vc, f, index);
+      if (result == VK_SUBOPTIMAL_KHR ||
+          result == VK_ERROR_OUT_OF_DATE_KHR)
+         recreate_swapchain(vc);
+      else if (result != VK_SUCCESS)
          return;
-
-      vkQueueWaitIdle(vc->queue);
    }
 }
 
@@ -1326,7 +2239,7 @@ static int display_plane_idx = -1;
 static int
 init_khr(struct vkcube *vc)
 {
-   init_vk(vc, VK_KHR_DISPLAY_EXTENSION_NAME);
+   init_vk(vc, VK_KHR_DISPLAY_EXTENSION_NAME, NULL);
    vc->image_format = VK_FORMAT_B8G8R8A8_SRGB;
    init_vk_objects(vc);
 
@@ -1529,35 +2442,39 @@ init_khr(struct vkcube *vc)
    return 0;
 }
 
+static volatile sig_atomic_t khr_quit;
+
+static void
+handle_khr_signal(int sig)
+{
+   khr_quit = 1;
+}
+
 static void
 mainloop_khr(struct vkcube *vc)
 {
-   while (1) {
+   /* There is no input on a bare display; stop on SIGINT or SIGTERM so
+    * the benchmark summaries still get printed. */
+   struct sigaction act = { .sa_handler = handle_khr_signal };
+   sigaction(SIGINT, &act, NULL);
+   sigaction(SIGTERM, &act, NULL);
+
+   while (!khr_quit) {
+      struct vkcube_frame *f = begin_frame(vc);
       uint32_t index;
       VkResult result = vkAcquireNextImageKHR(vc->device, vc->swap_chain, UINT64_MAX,
-                                     vc->semaphore, VK_NULL_HANDLE, &index);
+                                     f->acquire_semaphore, VK_NULL_HANDLE, &index);
       if (result != VK_SUCCESS)
          return;
 
-      assert(index <= MAX_NUM_IMAGES);
-      vc->model.render(vc, &vc->buffers[index], true);
-
-      vkQueuePresentKHR(vc->queue,
-         &(VkPresentInfoKHR) {
-            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-            .swapchainCount = 1,
-            .pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
-            .pImageIndices = (uint32_t[]) { index, },
-            .pResults = &result,
-         });
+      result = render_and_present(vc, f, index);
       if (result != VK_SUCCESS)
          return;
-
-      vkQueueWaitIdle(vc->queue);
    }
 }
 
 extern struct model cube_model;
+extern struct model cubes_model;
 
 static bool
 display_mode_from_string(const char *s, enum display_mode *mode)
@@ -1593,7 +2510,7 @@ static void
 print_usage(FILE *f)
 {
    const char *usage =
-      "usage: vkcube [-n] [-o <file>]\n"
+      "usage: vkcube [-n] [-o <file>] [-f <frames>] [-t <seconds>]\n"
       "\n"
       "  -n                      Don't initialize vt or kms, run headless. This\n"
       "                          option is equivalent to '-m headless'.\n"
@@ -1612,9 +2529,107 @@ print_usage(FILE *f)
       "                          corresponding to those number, just omit the number.\n"
       "\n"
       "  -o <file>               Path to output image when running headless.\n"
-      "                          Default is \"./cube.png\".\n"
+      "                          Default is \"./cube.png\". A .raw, .ppm or\n"
+      "                          .y4m extension selects that format, and \"-\"\n"
+      "                          streams to stdout.\n"
+      "\n"
+      "  -O <format>             Headless output format: \"png\", \"raw\"\n"
+      "                          (BGRA frames back to back), \"ppm\" (a P6\n"
+      "                          image per frame) or \"y4m\" (4:4:4 YUV4MPEG2).\n"
+      "                          Overrides the -o extension.\n"
       "\n"
       "  -p                      Attempt to use protected content (encrypted).\n"
+      "\n"
+      "  -f <frames>             Headless benchmark: render <frames> frames back\n"
+      "                          to back without writing an image, then print\n"
+      "                          fps and frame time statistics.\n"
+      "\n"
+      "  -t <seconds>            Headless benchmark: like -f, but stop after\n"
+      "                          <seconds>. If both are given, the first limit\n"
+      "                          reached ends the run.\n"
+      "\n"
+      "  -F <count>              Number of frames the CPU may queue ahead of the\n"
+      "                          GPU, 1 to 5. Default is 2.\n"
+      "\n"
+      "  -r <mode>               Command buffer recording, where <mode> is\n"
+      "                          \"dynamic\" (re-record every frame, the default),\n"
+      "                          \"static\" (record once, or once per draw order\n"
+      "                          with -z -M cubes, then resubmit) or\n"
+      "                          \"secondary\" (re-record every frame, with the\n"
+      "                          draws split across threads that each record\n"
+      "                          a secondary command buffer).\n"
+      "\n"
+      "  -T <threads>            Recording threads for '-r secondary', 1 to 16.\n"
+      "                          Default is the number of CPUs.\n"
+      "\n"
+      "  -D <draws>              Split each frame into <draws> draws, at most\n"
+      "                          one per cube. In '-r secondary' the draws are\n"
+      "                          divided between the threads, so threads only\n"
+      "                          get work with '-M cubes'. Default is one draw\n"
+      "                          per recording thread, or 1 otherwise.\n"
+      "\n"
+      "  -a <alloc>              Command buffer allocation, where <alloc> is\n"
+      "                          \"buffer\" (one shared pool, each command\n"
+      "                          buffer reset on its own, the default) or\n"
+      "                          \"pool\" (a transient pool per frame, reset\n"
+      "                          as a whole, one-time-submit recordings). \"pool\"\n"
+      "                          can't be combined with '-r static'.\n"
+      "\n"
+      "  -z                      Depth test against a transient depth buffer.\n"
+      "                          '-M cubes' then draws the grid front to back;\n"
+      "                          compare fragment invocations with -S.\n"
+      "\n"
+      "  -s <samples>            Multisample with 1, 2, 4, 8 or 16 samples per\n"
+      "                          pixel, resolved at the end of the render pass.\n"
+      "                          Default is 1.\n"
+      "\n"
+      "  -l <layout>             Vertex layout, where <layout> is \"separate\"\n"
+      "                          (one buffer binding per attribute),\n"
+      "                          \"interleaved\" (one binding, the default) or\n"
+      "                          \"packed\" (interleaved with 8-bit colors and\n"
+      "                          2:10:10:10 normals).\n"
+      "\n"
+      "  -c <dir>                Directory for the on-disk pipeline cache.\n"
+      "                          Default is $XDG_CACHE_HOME/vkcube, or\n"
+      "                          ~/.cache/vkcube. \"none\" disables the cache.\n"
+      "\n"
+      "  -j                      Print the time spent in each startup phase,\n"
+      "                          up to the first present, as one line of JSON\n"
+      "                          on stderr.\n"
+      "\n"
+      "  -g <seconds>            Measure the GPU time of each frame with\n"
+      "                          timestamp queries and print a histogram every\n"
+      "                          <seconds>, or only at exit if <seconds> is 0.\n"
+      "\n"
+      "  -S                      Count vertices, vertex shader invocations,\n"
+      "                          clipped primitives and fragment shader\n"
+      "                          invocations per frame with pipeline statistics\n"
+      "                          queries, and print the means at exit.\n"
+      "\n"
+      "  -d <ms>                 Advance the animation by a fixed <ms> per\n"
+      "                          frame instead of following the clock, so\n"
+      "                          every run renders the same frames.\n"
+      "\n"
+      "  -i <N>                  Headless benchmark: also write every <N>th\n"
+      "                          frame. PNGs go to cube-<frame>.png, encoded\n"
+      "                          on worker threads so they only slow\n"
+      "                          rendering down once the workers fall behind.\n"
+      "                          Other formats are appended to the -o stream.\n"
+      "\n"
+      "  -G <device>             Vulkan device to use: an index, a device UUID,\n"
+      "                          \"integrated\", \"discrete\", \"virtual\", \"cpu\"\n"
+      "                          or part of the device name. \"all\" runs the\n"
+      "                          headless benchmark on every device at once,\n"
+      "                          one thread each, and prints a summary.\n"
+      "\n"
+      "  -M <model>              Model to draw: \"cube\" (the default) or\n"
+      "                          \"cubes\", a grid of cubes drawn with instanced\n"
+      "                          draws, one unless -D is given. Benchmarks then\n"
+      "                          also report instances and triangles per\n"
+      "                          second.\n"
+      "\n"
+      "  -N <count>              Number of cubes for '-M cubes'. Default is\n"
+      "                          10000.\n"
       ;
 
    fprintf(f, "%s", usage);
@@ -1645,7 +2660,7 @@ parse_args(int argc, char *argv[])
     * The initial ':' in the optstring makes getopt return ':' when an option
     * is missing a required argument.
     */
-   static const char *optstring = "+:nm:w:h:o:k:p";
+   static const char *optstring = "+:nm:w:h:o:O:k:pf:t:F:r:l:c:jg:Sd:i:G:M:N:T:D:a:zs:";
 
    int opt;
    bool found_arg_headless = false;
@@ -1687,6 +2702,117 @@ parse_args(int argc, char *argv[])
       case 'p':
          protected_chain = true;
          break;
+      case 'f':
+         bench_frames = atoi(optarg);
+         if (bench_frames <= 0)
+            usage_error("option -f requires a positive frame count");
+         break;
+      case 't':
+         bench_seconds = atof(optarg);
+         if (bench_seconds <= 0)
+            usage_error("option -t requires a positive number of seconds");
+         break;
+      case 'F':
+         frames_in_flight = atoi(optarg);
+         if (frames_in_flight < 1 || frames_in_flight > MAX_FRAMES_IN_FLIGHT)
+            usage_error("option -F requires a count between 1 and %d",
+                        MAX_FRAMES_IN_FLIGHT);
+         break;
+      case 'r':
+         if (streq(optarg, "dynamic"))
+            record_mode = RECORD_MODE_DYNAMIC;
+         else if (streq(optarg, "static"))
+            record_mode = RECORD_MODE_STATIC;
+         else if (streq(optarg, "secondary"))
+            record_mode = RECORD_MODE_SECONDARY;
+         else
+            usage_error("option -r given bad recording mode");
+         break;
+      case 'l':
+         if (streq(optarg, "separate"))
+            vertex_layout = VERTEX_LAYOUT_SEPARATE;
+         else if (streq(optarg, "interleaved"))
+            vertex_layout = VERTEX_LAYOUT_INTERLEAVED;
+         else if (streq(optarg, "packed"))
+            vertex_layout = VERTEX_LAYOUT_PACKED;
+         else
+            usage_error("option -l given bad vertex layout");
+         break;
+      case 'c':
+         arg_pipeline_cache_dir = optarg;
+         break;
+      case 'j':
+         print_phases = true;
+         break;
+      case 'g':
+         gpu_timing_interval = atof(optarg);
+         if (gpu_timing_interval < 0)
+            usage_error("option -g requires a non-negative interval");
+         break;
+      case 'S':
+         pipeline_statistics = true;
+         break;
+      case 'd':
+         time_step_ms = atof(optarg);
+         if (time_step_ms <= 0)
+            usage_error("option -d requires a positive number of milliseconds");
+         break;
+      case 'i':
+         capture_interval = atoi(optarg);
+         if (capture_interval <= 0)
+            usage_error("option -i requires a positive frame interval");
+         break;
+      case 'O':
+         if (!output_format_from_name(optarg, &output_format))
+            usage_error("option -O given bad output format");
+         found_arg_output_format = true;
+         break;
+      case 'M':
+         if (streq(optarg, "cube"))
+            many_cubes = false;
+         else if (streq(optarg, "cubes"))
+            many_cubes = true;
+         else
+            usage_error("option -M given bad model");
+         break;
+      case 'N':
+         instance_count = atoi(optarg);
+         if (instance_count <= 0)
+            usage_error("option -N requires a positive count");
+         break;
+      case 'z':
+         depth_buffer = true;
+         break;
+      case 's':
+         samples = atoi(optarg);
+         if (samples < 1 || samples > 16 || (samples & (samples - 1)))
+            usage_error("option -s requires 1, 2, 4, 8 or 16 samples");
+         break;
+      case 'a':
+         if (streq(optarg, "buffer"))
+            reset_pools = false;
+         else if (streq(optarg, "pool"))
+            reset_pools = true;
+         else
+            usage_error("option -a given bad allocation mode");
+         break;
+      case 'T':
+         record_threads = atoi(optarg);
+         if (record_threads < 1 || record_threads > MAX_RECORD_THREADS)
+            usage_error("option -T requires a count between 1 and %d",
+                        MAX_RECORD_THREADS);
+         break;
+      case 'D':
+         draw_count = atoi(optarg);
+         if (draw_count <= 0)
+            usage_error("option -D requires a positive count");
+         break;
+      case 'G':
+         if (streq(optarg, "all"))
+            all_devices = true;
+         else
+            arg_device = optarg;
+         break;
       case '?':
          usage_error("invalid option '-%c'", optopt);
          break;
@@ -1702,6 +2828,34 @@ parse_args(int argc, char *argv[])
    if (found_arg_headless && found_arg_display_mode)
       usage_error("options -n and -m are mutually exclusive");
 
+   if (capture_interval > 0 && bench_frames == 0 && bench_seconds == 0)
+      usage_error("option -i requires -f or -t");
+
+   const char *ext = strrchr(arg_out_file, '.');
+   if (!found_arg_output_format && ext && !strchr(ext, '/'))
+      output_format_from_name(ext + 1, &output_format);
+
+   if (streq(arg_out_file, "-") && output_format == OUTPUT_FORMAT_PNG)
+      usage_error("option -o - requires a raw, ppm or y4m format");
+
+   if (instance_count > 0 && !many_cubes)
+      usage_error("option -N requires -M cubes");
+
+   if (record_threads > 0 && record_mode != RECORD_MODE_SECONDARY)
+      usage_error("option -T requires -r secondary");
+
+   if (reset_pools && record_mode == RECORD_MODE_STATIC)
+      usage_error("options -a pool and -r static are mutually exclusive");
+
+   if (all_devices) {
+      if (display_mode != DISPLAY_MODE_HEADLESS)
+         usage_error("option -G all requires headless mode");
+      if (bench_frames == 0 && bench_seconds == 0)
+         usage_error("option -G all requires -f or -t");
+      if (capture_interval > 0)
+         usage_error("options -G all and -i are mutually exclusive");
+   }
+
    if (optind != argc)
       usage_error("trailing args");
 }
@@ -1790,20 +2944,103 @@ mainloop(struct vkcube *vc)
       mainloop_khr(vc);
       break;
    case DISPLAY_MODE_HEADLESS:
-      vc->model.render(vc, &vc->buffers[0], false);
-      vkQueueWaitIdle(vc->queue);
-      write_buffer(vc, &vc->buffers[0]);
+      mainloop_headless(vc);
       break;
    }
 }
 
+static uint32_t
+count_physical_devices(void)
+{
+   VkInstance instance;
+   uint32_t count = 0;
+
+   VkResult res = vkCreateInstance(&(VkInstanceCreateInfo) {
+         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+         .pApplicationInfo = &(VkApplicationInfo) {
+            .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+            .pApplicationName = "vkcube",
+            .apiVersion = VK_MAKE_VERSION(1, 1, 0),
+         },
+      },
+      NULL,
+      &instance);
+   fail_if(res != VK_SUCCESS, "Failed to create Vulkan instance.\n");
+
+   vkEnumeratePhysicalDevices(instance, &count, NULL);
+   vkDestroyInstance(instance, NULL);
+
+   return count;
+}
+
+static void *
+run_device(void *data)
+{
+   struct vkcube *vc = data;
+
+   if (init_headless(vc) == -1)
+      fail("failed to initialize headless mode");
+   mainloop_headless(vc);
+   gpu_timer_finish(vc);
+   pipeline_stats_finish(vc);
+   if (vc->recorder)
+      recorder_destroy(vc->recorder);
+
+   return NULL;
+}
+
+/* Runs the headless benchmark on every device in parallel. Each thread gets
+ * its own copy of the template vkcube, with its own instance and device, so
+ * nothing Vulkan is shared between them. */
+static void
+run_all_devices(const struct vkcube *template)
+{
+   uint32_t count = count_physical_devices();
+   fail_if(count == 0, "No Vulkan devices found.\n");
+
+   struct vkcube *vcs = calloc(count, sizeof(*vcs));
+   pthread_t threads[count];
+   fail_if(!vcs, "out of memory");
+
+   for (uint32_t i = 0; i < count; i++) {
+      vcs[i] = *template;
+      vcs[i].device_index = i;
+      fail_if(pthread_create(&threads[i], NULL, run_device, &vcs[i]) != 0,
+              "failed to start thread for device %u", i);
+   }
+
+   for (uint32_t i = 0; i < count; i++)
+      pthread_join(threads[i], NULL);
+
+   for (uint32_t i = 0; i < count; i++) {
+      struct vkcube *vc = &vcs[i];
+
+      printf("device %u, %s: %u frames in %.3f s, %.1f fps\n",
+             i, vc->properties.deviceName, vc->bench_frames_done,
+             vc->bench_elapsed / 1e9,
+             vc->bench_frames_done * 1e9 / vc->bench_elapsed);
+   }
+
+   free(vcs);
+}
+
 int main(int argc, char *argv[])
 {
-   struct vkcube vc;
+   struct vkcube vc = { 0 };
 
    parse_args(argc, argv);
+   phase_timer_init(&vc.phases, print_phases);
+
+   /* Frames streamed to stdout must not get mixed up with our messages, so
+    * keep the real stdout for the stream and point fd 1 at stderr. */
+   if (streq(arg_out_file, "-")) {
+      output_fd = dup(STDOUT_FILENO);
+      fail_if(output_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0,
+              "failed to redirect stdout: %m");
+   }
 
-   vc.model = cube_model;
+   vc.model = many_cubes ? cubes_model : cube_model;
+   vc.instance_count = instance_count > 0 ? instance_count : 10000;
    vc.gbm_device = NULL;
 #if defined(ENABLE_XCB)
    vc.xcb.window = XCB_NONE;
@@ -1814,10 +3051,47 @@ int main(int argc, char *argv[])
    vc.width = width;
    vc.height = height;
    vc.protected = protected_chain;
-   gettimeofday(&vc.start_tv, NULL);
+   vc.pipeline_statistics = pipeline_statistics;
+   vc.device_index = -1;
+   vc.frames_in_flight = frames_in_flight;
+   vc.record_mode = record_mode;
+   vc.reset_pools = reset_pools;
+   vc.depth = depth_buffer;
+   vc.samples = samples;
+   if (record_threads > 0) {
+      vc.record_threads = record_threads;
+   } else {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      vc.record_threads = cpus < 1 ? 1 :
+                          cpus > MAX_RECORD_THREADS ? MAX_RECORD_THREADS : cpus;
+   }
+   if (draw_count > 0)
+      vc.draw_count = draw_count;
+   else
+      vc.draw_count = record_mode == RECORD_MODE_SECONDARY ?
+                      vc.record_threads : 1;
+   vc.vertex_layout = vertex_layout;
+   if (!arg_pipeline_cache_dir)
+      vc.pipeline_cache_dir = default_pipeline_cache_dir();
+   else if (streq(arg_pipeline_cache_dir, "none"))
+      vc.pipeline_cache_dir = NULL;
+   else
+      vc.pipeline_cache_dir = xstrdup(arg_pipeline_cache_dir);
+   vc.start_time = get_time_ns();
+   vc.time_step = time_step_ms * 1e6;
+   vc.frame_count = 0;
+
+   if (all_devices) {
+      run_all_devices(&vc);
+      return 0;
+   }
 
    init_display(&vc);
    mainloop(&vc);
+   gpu_timer_finish(&vc);
+   pipeline_stats_finish(&vc);
+   if (vc.recorder)
+      recorder_destroy(vc.recorder);
 
    return 0;
 }
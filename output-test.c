@@ -0,0 +1,230 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Writes a few frames in each stream format, with tightly packed and
+ * padded rows, and compares the stream byte for byte against one built
+ * here from a palette with known RGB and BT.601 YUV values. */
+
+#define _GNU_SOURCE /* for fileno() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define WIDTH 7
+#define HEIGHT 3
+#define FRAMES 2
+#define MAX_PADDING 12
+#define MAX_STREAM_SIZE (64 + FRAMES * (16 + WIDTH * HEIGHT * 4))
+
+static const struct {
+   uint8_t r, g, b;
+   uint8_t y, u, v;
+} palette[] = {
+   {   0,   0,   0,   16, 128, 128 },
+   { 255, 255, 255,  235, 128, 128 },
+   { 255,   0,   0,   82,  90, 240 },
+   {   0, 255,   0,  144,  54,  34 },
+   {   0,   0, 255,   41, 240, 110 },
+};
+
+#define PALETTE_SIZE (sizeof(palette) / sizeof(palette[0]))
+
+static uint8_t pixels[HEIGHT * (WIDTH * 4 + MAX_PADDING)];
+static uint8_t expected[MAX_STREAM_SIZE];
+static uint8_t actual[MAX_STREAM_SIZE + 1];
+
+void noreturn
+failv(const char *format, va_list args)
+{
+   vfprintf(stderr, format, args);
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
+void printflike(1,2) noreturn
+fail(const char *format, ...)
+{
+   va_list args;
+
+   va_start(args, format);
+   failv(format, args);
+   va_end(args);
+}
+
+void printflike(2, 3)
+fail_if(int cond, const char *format, ...)
+{
+   va_list args;
+
+   if (!cond)
+      return;
+
+   va_start(args, format);
+   failv(format, args);
+   va_end(args);
+}
+
+static uint32_t
+color(uint32_t frame, uint32_t x, uint32_t y)
+{
+   return (frame + x + y * WIDTH) % PALETTE_SIZE;
+}
+
+/* BGRA rows with garbage in the padding, which must never be written. */
+static void
+fill_frame(uint32_t frame, uint32_t stride)
+{
+   memset(pixels, 0xee, sizeof(pixels));
+
+   for (uint32_t y = 0; y < HEIGHT; y++) {
+      for (uint32_t x = 0; x < WIDTH; x++) {
+         uint8_t *p = &pixels[y * stride + x * 4];
+         uint32_t c = color(frame, x, y);
+         p[0] = palette[c].b;
+         p[1] = palette[c].g;
+         p[2] = palette[c].r;
+         p[3] = 0xff;
+      }
+   }
+}
+
+static size_t
+append(size_t size, const void *data, size_t len)
+{
+   memcpy(&expected[size], data, len);
+   return size + len;
+}
+
+static size_t
+expected_frame(enum output_format format, uint32_t frame, size_t size)
+{
+   char header[64];
+
+   switch (format) {
+   case OUTPUT_FORMAT_RAW:
+      for (uint32_t y = 0; y < HEIGHT; y++) {
+         for (uint32_t x = 0; x < WIDTH; x++) {
+            uint32_t c = color(frame, x, y);
+            uint8_t bgra[] = {
+               palette[c].b, palette[c].g, palette[c].r, 0xff
+            };
+            size = append(size, bgra, sizeof(bgra));
+         }
+      }
+      break;
+   case OUTPUT_FORMAT_PPM:
+      snprintf(header, sizeof(header), "P6\n%u %u\n255\n", WIDTH, HEIGHT);
+      size = append(size, header, strlen(header));
+      for (uint32_t y = 0; y < HEIGHT; y++) {
+         for (uint32_t x = 0; x < WIDTH; x++) {
+            uint32_t c = color(frame, x, y);
+            uint8_t rgb[] = { palette[c].r, palette[c].g, palette[c].b };
+            size = append(size, rgb, sizeof(rgb));
+         }
+      }
+      break;
+   case OUTPUT_FORMAT_Y4M:
+      size = append(size, "FRAME\n", 6);
+      for (uint32_t plane = 0; plane < 3; plane++) {
+         for (uint32_t y = 0; y < HEIGHT; y++) {
+            for (uint32_t x = 0; x < WIDTH; x++) {
+               uint32_t c = color(frame, x, y);
+               uint8_t yuv[] = { palette[c].y, palette[c].u, palette[c].v };
+               size = append(size, &yuv[plane], 1);
+            }
+         }
+      }
+      break;
+   default:
+      fail("unexpected output format");
+   }
+
+   return size;
+}
+
+static bool
+check(const char *name, uint32_t padding)
+{
+   enum output_format format;
+   uint32_t stride = WIDTH * 4 + padding;
+   size_t size = 0;
+
+   fail_if(!output_format_from_name(name, &format),
+           "%s: not a known output format", name);
+
+   FILE *f = tmpfile();
+   fail_if(!f, "failed to create temporary file");
+
+   /* The stream closes its fd, so hand it a copy and read back through f. */
+   struct output *o = output_open(format, dup(fileno(f)), WIDTH, HEIGHT,
+                                  30, 1);
+   if (format == OUTPUT_FORMAT_Y4M) {
+      const char *header = "YUV4MPEG2 W7 H3 F30:1 Ip A1:1 C444\n";
+      size = append(size, header, strlen(header));
+   }
+
+   for (uint32_t frame = 0; frame < FRAMES; frame++) {
+      fill_frame(frame, stride);
+      output_write_frame(o, pixels, stride);
+      size = expected_frame(format, frame, size);
+   }
+   output_close(o);
+
+   rewind(f);
+   size_t actual_size = fread(actual, 1, sizeof(actual), f);
+   fclose(f);
+
+   if (actual_size == size && memcmp(actual, expected, size) == 0)
+      return true;
+
+   fprintf(stderr, "%s: stream mismatch with %u bytes of row padding "
+           "(%zu bytes, expected %zu)\n", name, padding, actual_size, size);
+
+   return false;
+}
+
+int main(int argc, char *argv[])
+{
+   static const char *const names[] = { "raw", "ppm", "y4m" };
+   enum output_format format;
+   int failures = 0;
+
+   fail_if(!output_format_from_name("bgra", &format) ||
+           format != OUTPUT_FORMAT_RAW, "bgra is not an alias for raw");
+   fail_if(!output_format_from_name("png", &format) ||
+           format != OUTPUT_FORMAT_PNG, "png is not a known format");
+   fail_if(output_format_from_name("jpeg", &format),
+           "jpeg should not be a known format");
+
+   for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      int format_failures = 0;
+
+      format_failures += !check(names[i], 0);
+      format_failures += !check(names[i], MAX_PADDING);
+      printf("%s: %s\n", names[i], format_failures ? "FAIL" : "ok");
+      failures += format_failures;
+   }
+
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* On-disk VkPipelineCache, so repeated runs skip shader compilation. */
+
+#define _GNU_SOURCE /* for asprintf() */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/* The cache file name carries everything that has to match for the data to
+ * be usable: the device, the driver version and the driver's own cache
+ * UUID. The header is still checked on load, since drivers are free to
+ * reject data that doesn't match and the file may be truncated. The
+ * device's index keeps identical devices, which -G all runs at once, on
+ * separate files. */
+static char *
+cache_path(struct vkcube *vc)
+{
+   const VkPhysicalDeviceProperties *props = &vc->properties;
+   char uuid[2 * VK_UUID_SIZE + 1];
+   char *path;
+
+   for (int i = 0; i < VK_UUID_SIZE; i++)
+      sprintf(&uuid[2 * i], "%02x", props->pipelineCacheUUID[i]);
+
+   if (asprintf(&path, "%s/pipeline-%d-%04x-%04x-%08x-%s.bin",
+                vc->pipeline_cache_dir, vc->device_index, props->vendorID,
+                props->deviceID, props->driverVersion, uuid) < 0)
+      fail("out of memory");
+
+   return path;
+}
+
+static bool
+header_valid(struct vkcube *vc, const void *data, size_t size)
+{
+   VkPipelineCacheHeaderVersionOne header;
+
+   if (size < sizeof(header))
+      return false;
+
+   memcpy(&header, data, sizeof(header));
+
+   return header.headerSize >= sizeof(header) &&
+          header.headerSize <= size &&
+          header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+          header.vendorID == vc->properties.vendorID &&
+          header.deviceID == vc->properties.deviceID &&
+          memcmp(header.pipelineCacheUUID, vc->properties.pipelineCacheUUID,
+                 VK_UUID_SIZE) == 0;
+}
+
+static void *
+read_file(const char *path, size_t *size)
+{
+   FILE *f = fopen(path, "rb");
+   void *data = NULL;
+   long len;
+
+   if (!f)
+      return NULL;
+
+   if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 &&
+       fseek(f, 0, SEEK_SET) == 0) {
+      data = malloc(len);
+      if (data && fread(data, 1, len, f) == (size_t) len) {
+         *size = len;
+      } else {
+         free(data);
+         data = NULL;
+      }
+   }
+
+   fclose(f);
+
+   return data;
+}
+
+static bool
+make_dirs(const char *dir)
+{
+   char *tmp = strdup(dir);
+   bool ok = tmp != NULL;
+
+   for (char *p = tmp + 1; ok && *p; p++) {
+      if (*p != '/')
+         continue;
+      *p = '\0';
+      ok = mkdir(tmp, 0755) == 0 || errno == EEXIST;
+      *p = '/';
+   }
+
+   ok = ok && (mkdir(tmp, 0755) == 0 || errno == EEXIST);
+   free(tmp);
+
+   return ok;
+}
+
+/* Creates the pipeline cache, seeded from disk when a valid cache file
+ * exists. *loaded_size is set to the size of that data, or 0 if nothing
+ * was loaded. */
+VkPipelineCache
+load_pipeline_cache(struct vkcube *vc, size_t *loaded_size)
+{
+   VkPipelineCache cache;
+   void *data = NULL;
+   size_t size = 0;
+
+   if (vc->pipeline_cache_dir) {
+      char *path = cache_path(vc);
+      data = read_file(path, &size);
+      if (data && !header_valid(vc, data, size)) {
+         printf("ignoring stale pipeline cache %s\n", path);
+         free(data);
+         data = NULL;
+         size = 0;
+      }
+      free(path);
+   }
+
+   VkResult r = vkCreatePipelineCache(vc->device,
+      &(VkPipelineCacheCreateInfo) {
+         .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+         .initialDataSize = size,
+         .pInitialData = data,
+      },
+      NULL,
+      &cache);
+   fail_if(r != VK_SUCCESS, "vkCreatePipelineCache failed");
+
+   free(data);
+   *loaded_size = size;
+
+   return cache;
+}
+
+/* Writes the cache data to a uniquely named temporary file and renames it
+ * into place, so concurrent runs and -G all threads never see a partially
+ * written cache. Nothing is written
+ * when the data matches the file on disk; a driver may have added entries
+ * to a seeded cache, so seeding alone doesn't mean the file is current. */
+void
+save_pipeline_cache(struct vkcube *vc, VkPipelineCache cache)
+{
+   size_t size;
+   void *data;
+
+   if (!vc->pipeline_cache_dir)
+      return;
+
+   if (vkGetPipelineCacheData(vc->device, cache, &size, NULL) != VK_SUCCESS ||
+       size == 0)
+      return;
+
+   data = malloc(size);
+   fail_if(!data, "out of memory");
+
+   if (vkGetPipelineCacheData(vc->device, cache, &size, data) != VK_SUCCESS) {
+      free(data);
+      return;
+   }
+
+   char *path = cache_path(vc), *tmp;
+   size_t old_size = 0;
+   void *old = read_file(path, &old_size);
+   bool current = old && old_size == size && memcmp(old, data, size) == 0;
+   free(old);
+   if (current) {
+      free(path);
+      free(data);
+      return;
+   }
+
+   if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+      fail("out of memory");
+
+   int fd = make_dirs(vc->pipeline_cache_dir) ? mkstemp(tmp) : -1;
+   FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+   if (f) {
+      bool ok = fwrite(data, 1, size, f) == size;
+      ok = fclose(f) == 0 && ok;
+      if (!ok || rename(tmp, path) != 0)
+         unlink(tmp);
+   } else {
+      if (fd >= 0) {
+         close(fd);
+         unlink(tmp);
+      }
+      fprintf(stderr, "failed to write pipeline cache %s\n", path);
+   }
+
+   free(tmp);
+   free(path);
+   free(data);
+}
+
+/* $XDG_CACHE_HOME/vkcube, falling back to ~/.cache/vkcube, or NULL if
+ * neither is set. */
+char *
+default_pipeline_cache_dir(void)
+{
+   const char *xdg = getenv("XDG_CACHE_HOME");
+   const char *home = getenv("HOME");
+   char *dir;
+   int n;
+
+   if (xdg && xdg[0] == '/')
+      n = asprintf(&dir, "%s/vkcube", xdg);
+   else if (home && home[0])
+      n = asprintf(&dir, "%s/.cache/vkcube", home);
+   else
+      return NULL;
+
+   if (n < 0)
+      fail("out of memory");
+
+   return dir;
+}
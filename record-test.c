@@ -0,0 +1,120 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Runs many back to back jobs through recorders of a few sizes and checks
+ * that every job ran exactly once on every worker before recorder_run()
+ * returned. Worth running under ThreadSanitizer as well. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define MAX_WORKERS 16
+#define JOBS 5000
+
+struct job {
+   uint32_t generation;
+   uint32_t runs[MAX_WORKERS];
+};
+
+void noreturn
+failv(const char *format, va_list args)
+{
+   vfprintf(stderr, format, args);
+   fprintf(stderr, "\n");
+   exit(1);
+}
+
+void printflike(1,2) noreturn
+fail(const char *format, ...)
+{
+   va_list args;
+
+   va_start(args, format);
+   failv(format, args);
+   va_end(args);
+}
+
+void printflike(2, 3)
+fail_if(int cond, const char *format, ...)
+{
+   va_list args;
+
+   if (!cond)
+      return;
+
+   va_start(args, format);
+   failv(format, args);
+   va_end(args);
+}
+
+/* Each worker only touches its own slot, like the recording threads only
+ * touch their own command pool. */
+static void
+run_job(void *data, uint32_t worker)
+{
+   struct job *job = data;
+
+   if (worker < MAX_WORKERS)
+      job->runs[worker]++;
+}
+
+static bool
+check(uint32_t worker_count)
+{
+   struct recorder *r = recorder_create(worker_count);
+   struct job job = { 0 };
+
+   for (job.generation = 0; job.generation < JOBS; job.generation++) {
+      recorder_run(r, run_job, &job);
+
+      for (uint32_t i = 0; i < MAX_WORKERS; i++) {
+         uint32_t expected = i < worker_count ? job.generation + 1 : 0;
+         if (job.runs[i] != expected) {
+            fprintf(stderr, "%u workers: after job %u, worker %u has run "
+                    "%u jobs\n", worker_count, job.generation, i, job.runs[i]);
+            recorder_destroy(r);
+            return false;
+         }
+      }
+   }
+
+   recorder_destroy(r);
+
+   return true;
+}
+
+int main(int argc, char *argv[])
+{
+   static const uint32_t worker_counts[] = { 1, 2, 3, 8, MAX_WORKERS };
+   const uint32_t count = sizeof(worker_counts) / sizeof(worker_counts[0]);
+   int failures = 0;
+
+   for (uint32_t i = 0; i < count; i++) {
+      bool ok = check(worker_counts[i]);
+
+      printf("%u workers: %s\n", worker_counts[i], ok ? "ok" : "FAIL");
+      failures += !ok;
+   }
+
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* A fixed set of threads that record secondary command buffers. Each call
+ * to recorder_run() hands the same job to every worker and returns once
+ * all of them have finished it, so the caller can execute the results. */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+struct recorder_thread {
+   struct recorder *r;
+   uint32_t index;
+   pthread_t thread;
+};
+
+struct recorder {
+   pthread_mutex_t lock;
+   pthread_cond_t work_cond;    /* a new job was posted, or quit was set */
+   pthread_cond_t done_cond;    /* the last worker finished the job */
+
+   void (*func)(void *data, uint32_t worker);
+   void *data;
+   uint64_t generation;         /* bumped for every posted job */
+   uint32_t remaining;
+   bool quit;
+
+   uint32_t worker_count;
+   struct recorder_thread workers[];
+};
+
+static void *
+recorder_worker(void *data)
+{
+   struct recorder_thread *t = data;
+   struct recorder *r = t->r;
+   uint64_t seen = 0;
+
+   pthread_mutex_lock(&r->lock);
+   for (;;) {
+      while (r->generation == seen && !r->quit)
+         pthread_cond_wait(&r->work_cond, &r->lock);
+      if (r->quit)
+         break;
+
+      seen = r->generation;
+      pthread_mutex_unlock(&r->lock);
+
+      r->func(r->data, t->index);
+
+      pthread_mutex_lock(&r->lock);
+      if (--r->remaining == 0)
+         pthread_cond_signal(&r->done_cond);
+   }
+   pthread_mutex_unlock(&r->lock);
+
+   return NULL;
+}
+
+struct recorder *
+recorder_create(uint32_t worker_count)
+{
+   struct recorder *r;
+
+   r = calloc(1, sizeof(*r) + worker_count * sizeof(r->workers[0]));
+   fail_if(!r, "out of memory");
+
+   r->worker_count = worker_count;
+
+   pthread_mutex_init(&r->lock, NULL);
+   pthread_cond_init(&r->work_cond, NULL);
+   pthread_cond_init(&r->done_cond, NULL);
+
+   for (uint32_t i = 0; i < worker_count; i++) {
+      r->workers[i] = (struct recorder_thread) { .r = r, .index = i };
+      int ret = pthread_create(&r->workers[i].thread, NULL,
+                               recorder_worker, &r->workers[i]);
+      fail_if(ret != 0, "failed to create recording thread");
+   }
+
+   return r;
+}
+
+/* Runs func(data, worker) once on every worker and waits for all of them. */
+void
+recorder_run(struct recorder *r, void (*func)(void *data, uint32_t worker),
+             void *data)
+{
+   pthread_mutex_lock(&r->lock);
+   r->func = func;
+   r->data = data;
+   r->remaining = r->worker_count;
+   r->generation++;
+   pthread_cond_broadcast(&r->work_cond);
+   while (r->remaining > 0)
+      pthread_cond_wait(&r->done_cond, &r->lock);
+   pthread_mutex_unlock(&r->lock);
+}
+
+void
+recorder_destroy(struct recorder *r)
+{
+   pthread_mutex_lock(&r->lock);
+   r->quit = true;
+   pthread_cond_broadcast(&r->work_cond);
+   pthread_mutex_unlock(&r->lock);
+
+   for (uint32_t i = 0; i < r->worker_count; i++)
+      pthread_join(r->workers[i].thread, NULL);
+
+   pthread_mutex_destroy(&r->lock);
+   pthread_cond_destroy(&r->work_cond);
+   pthread_cond_destroy(&r->done_cond);
+   free(r);
+}
@@ -0,0 +1,96 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks every swizzle kernel built for this CPU against swizzle_scalar(),
+ * for all counts up to a few vectors' worth so each main loop and tail
+ * length is hit, out of place at odd offsets and in place. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "swizzle.h"
+
+#define MAX_COUNT 67
+#define GUARD 16
+#define BUFFER_SIZE (GUARD + 1 + MAX_COUNT * 4 + GUARD)
+
+static uint8_t src[BUFFER_SIZE];
+static uint8_t expected[BUFFER_SIZE];
+static uint8_t actual[BUFFER_SIZE];
+
+static void
+fill(uint8_t *buf, size_t size, uint32_t seed)
+{
+   for (size_t i = 0; i < size; i++) {
+      seed = seed * 1103515245 + 12345;
+      buf[i] = seed >> 16;
+   }
+}
+
+static bool
+check(const struct swizzle_kernel *k, size_t count, size_t offset,
+      bool in_place)
+{
+   fill(src, sizeof(src), count * 131 + offset);
+   fill(expected, sizeof(expected), 7);
+   memcpy(actual, expected, sizeof(actual));
+
+   swizzle_scalar(&expected[GUARD + offset], &src[GUARD + offset], count);
+
+   if (in_place) {
+      memcpy(&actual[GUARD + offset], &src[GUARD + offset], count * 4);
+      k->func(&actual[GUARD + offset], &actual[GUARD + offset], count);
+   } else {
+      k->func(&actual[GUARD + offset], &src[GUARD + offset], count);
+   }
+
+   /* Compares the guard bytes too, so writes past either end show up. */
+   if (memcmp(actual, expected, sizeof(actual)) == 0)
+      return true;
+
+   fprintf(stderr, "%s: mismatch for %zu pixels at offset %zu%s\n",
+           k->name, count, offset, in_place ? " in place" : "");
+
+   return false;
+}
+
+int main(int argc, char *argv[])
+{
+   struct swizzle_kernel kernels[MAX_SWIZZLE_KERNELS];
+   uint32_t kernel_count = swizzle_get_kernels(kernels);
+   int failures = 0;
+
+   for (uint32_t i = 0; i < kernel_count; i++) {
+      int kernel_failures = 0;
+
+      for (size_t count = 0; count <= MAX_COUNT; count++) {
+         for (size_t offset = 0; offset <= 1; offset++) {
+            kernel_failures += !check(&kernels[i], count, offset, false);
+            kernel_failures += !check(&kernels[i], count, offset, true);
+         }
+      }
+      printf("%s: %s\n", kernels[i].name, kernel_failures ? "FAIL" : "ok");
+      failures += kernel_failures;
+   }
+
+   return failures ? 1 : 0;
+}
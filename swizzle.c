@@ -0,0 +1,161 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* BGRA to RGBA conversion for image output, with SIMD kernels picked at
+ * runtime. Every kernel must produce exactly what swizzle_scalar() does. */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "swizzle.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+void
+swizzle_scalar(uint8_t *dst, const uint8_t *src, size_t count)
+{
+   for (size_t i = 0; i < count; i++) {
+      uint32_t pixel;
+
+      memcpy(&pixel, &src[i * 4], sizeof(pixel));
+      dst[i * 4 + 0] = (pixel & 0xff0000) >> 16;
+      dst[i * 4 + 1] = (pixel & 0x00ff00) >>  8;
+      dst[i * 4 + 2] = (pixel & 0x0000ff) >>  0;
+      dst[i * 4 + 3] = 0xff;
+   }
+}
+
+#if defined(__SSE2__)
+/* SSE2 has no byte shuffle, so move red and blue with 32-bit shifts. */
+static void
+swizzle_sse2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+   const __m128i byte0 = _mm_set1_epi32(0x000000ff);
+   const __m128i byte1 = _mm_set1_epi32(0x0000ff00);
+   const __m128i alpha = _mm_set1_epi32(0xff000000);
+   size_t i;
+
+   for (i = 0; i + 4 <= count; i += 4) {
+      __m128i p = _mm_loadu_si128((const __m128i *) &src[i * 4]);
+      __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), byte0);
+      __m128i g = _mm_and_si128(p, byte1);
+      __m128i b = _mm_slli_epi32(_mm_and_si128(p, byte0), 16);
+      p = _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, alpha));
+      _mm_storeu_si128((__m128i *) &dst[i * 4], p);
+   }
+
+   swizzle_scalar(&dst[i * 4], &src[i * 4], count - i);
+}
+#endif
+
+#if defined(HAVE_AVX2)
+__attribute__((target("avx2"))) static void
+swizzle_avx2(uint8_t *dst, const uint8_t *src, size_t count)
+{
+   const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                            10, 9, 8, 11, 14, 13, 12, 15,
+                                            2, 1, 0, 3, 6, 5, 4, 7,
+                                            10, 9, 8, 11, 14, 13, 12, 15);
+   const __m256i alpha = _mm256_set1_epi32(0xff000000);
+   size_t i;
+
+   for (i = 0; i + 8 <= count; i += 8) {
+      __m256i p = _mm256_loadu_si256((const __m256i *) &src[i * 4]);
+      p = _mm256_or_si256(_mm256_shuffle_epi8(p, shuffle), alpha);
+      _mm256_storeu_si256((__m256i *) &dst[i * 4], p);
+   }
+
+   swizzle_scalar(&dst[i * 4], &src[i * 4], count - i);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void
+swizzle_neon(uint8_t *dst, const uint8_t *src, size_t count)
+{
+   size_t i;
+
+   for (i = 0; i + 16 <= count; i += 16) {
+      uint8x16x4_t p = vld4q_u8(&src[i * 4]);
+      uint8x16_t b = p.val[0];
+      p.val[0] = p.val[2];
+      p.val[2] = b;
+      p.val[3] = vdupq_n_u8(0xff);
+      vst4q_u8(&dst[i * 4], p);
+   }
+
+   swizzle_scalar(&dst[i * 4], &src[i * 4], count - i);
+}
+#endif
+
+uint32_t
+swizzle_get_kernels(struct swizzle_kernel *kernels)
+{
+   uint32_t count = 0;
+
+   kernels[count++] = (struct swizzle_kernel) { "scalar", swizzle_scalar };
+
+#if defined(__SSE2__)
+   kernels[count++] = (struct swizzle_kernel) { "sse2", swizzle_sse2 };
+#endif
+
+#if defined(HAVE_AVX2)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+      kernels[count++] = (struct swizzle_kernel) { "avx2", swizzle_avx2 };
+#endif
+
+#if defined(__ARM_NEON)
+   kernels[count++] = (struct swizzle_kernel) { "neon", swizzle_neon };
+#endif
+
+   return count;
+}
+
+static swizzle_func swizzle_impl;
+static pthread_once_t swizzle_once = PTHREAD_ONCE_INIT;
+
+static void
+swizzle_init(void)
+{
+   struct swizzle_kernel kernels[MAX_SWIZZLE_KERNELS];
+   uint32_t count = swizzle_get_kernels(kernels);
+
+   swizzle_impl = kernels[count - 1].func;
+}
+
+void
+swizzle_bgra_to_rgba(void *dst, const void *src, size_t count)
+{
+   pthread_once(&swizzle_once, swizzle_init);
+   swizzle_impl(dst, src, count);
+}
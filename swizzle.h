@@ -0,0 +1,49 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SWIZZLE_H
+#define SWIZZLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Converts count BGRA pixels to RGBA with opaque alpha. dst may equal src. */
+void swizzle_bgra_to_rgba(void *dst, const void *src, size_t count);
+
+/* Internal: the individual kernels, exposed so swizzle-test can check them
+ * against the reference. */
+
+typedef void (*swizzle_func)(uint8_t *dst, const uint8_t *src, size_t count);
+
+struct swizzle_kernel {
+   const char *name;
+   swizzle_func func;
+};
+
+#define MAX_SWIZZLE_KERNELS 4
+
+void swizzle_scalar(uint8_t *dst, const uint8_t *src, size_t count);
+
+/* Fills kernels with every kernel built in and usable on this CPU, from the
+ * scalar reference up to the preferred one, and returns how many. */
+uint32_t swizzle_get_kernels(struct swizzle_kernel *kernels);
+
+#endif